@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+# Benchmark shell_complete against mock_llm_server (run by "make bench").
+#
+# Sends BENCH_REQUESTS completions, BENCH_CONCURRENCY at a time, first as
+# one-shot runs and then through the daemon, and reports throughput and
+# end-to-end latency percentiles for each, followed by the --stats table
+# (latency as seen by the provider requests).
+#
+#   BENCH_REQUESTS      completions per mode (default 200)
+#   BENCH_CONCURRENCY   parallel clients (default 8)
+#   BENCH_PROFILE       mock latency profile: fast, typical, slow, flaky
+#                       (default typical)
+#   BENCH_MOCK_OPTIONS  further mock_llm_server options, e.g. "--ttfb-ms 50"
+
+set -euo pipefail
+
+cd "$(dirname "$0")"
+requests=${BENCH_REQUESTS:-200}
+concurrency=${BENCH_CONCURRENCY:-8}
+profile=${BENCH_PROFILE:-typical}
+
+work=$(mktemp -d)
+mock_pid=""
+daemon_pid=""
+cleanup() {
+    [[ -n "$daemon_pid" ]] && kill "$daemon_pid" 2>/dev/null
+    [[ -n "$mock_pid" ]] && kill "$mock_pid" 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# shellcheck disable=SC2086
+./mock_llm_server --port 0 --profile "$profile" ${BENCH_MOCK_OPTIONS:-} >"$work/mock.out" &
+mock_pid=$!
+for _ in $(seq 50); do
+    grep -q listening "$work/mock.out" 2>/dev/null && break
+    sleep 0.1
+done
+origin=$(sed -n 's/.*listening on //p' "$work/mock.out")
+[[ -n "$origin" ]] || { echo "mock_llm_server did not start" >&2; exit 1; }
+
+# Everything the runs keep goes to the scratch directory; the completion
+# cache is off so every request reaches the mock
+export CEREBRAS_API_KEY=bench ANTHROPIC_API_KEY=bench
+export SHELL_COMPLETE_CEREBRAS_URL="$origin" SHELL_COMPLETE_ANTHROPIC_URL="$origin"
+export SHELL_COMPLETE_CACHE=0 SHELL_COMPLETE_PREWARM=0
+export SHELL_COMPLETE_SOCKET="$work/daemon.sock"
+export XDG_CACHE_HOME="$work/cache"
+unset SHELL_COMPLETE_PROVIDER SHELL_COMPLETE_HEDGE_MS
+
+# One request: prints its latency in microseconds, or "fail"
+run_one() {
+    local start=$EPOCHREALTIME out
+    out=$(./shell_complete "bench request $1" 2>/dev/null) || true
+    local end=$EPOCHREALTIME
+    if [[ -n "$out" ]]; then
+        echo $(( ${end/./} - ${start/./} ))
+    else
+        echo fail
+    fi
+}
+export -f run_one
+
+run_mode() {
+    local mode=$1 results="$work/$1.results"
+    local start=$EPOCHREALTIME
+    seq "$requests" | xargs -P "$concurrency" -I{} bash -c 'run_one {}' >"$results"
+    local end=$EPOCHREALTIME
+    local wall_us=$(( ${end/./} - ${start/./} ))
+
+    echo "== $mode: $requests requests, concurrency $concurrency, mock profile $profile"
+    { grep -v fail "$results" || true; } | sort -n | awk -v total="$requests" -v wall="$wall_us" '
+        { v[NR] = $1 }
+        function pct(q,  i) { i = int(q * NR + 0.999999); if (i < 1) i = 1; return v[i] / 1000 }
+        END {
+            printf "throughput %.1f req/s, failed %d\n", total / (wall / 1e6), total - NR
+            if (NR) printf "latency ms: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", pct(0.5), pct(0.9), pct(0.99), v[NR] / 1000
+        }'
+    echo
+    ./shell_complete --stats | tail -n +3
+    echo
+}
+
+# Statistics are kept per mode; the daemon picks up XDG_STATE_HOME when
+# it starts
+export XDG_STATE_HOME="$work/state-one-shot"
+run_mode one-shot
+
+export XDG_STATE_HOME="$work/state-daemon"
+./shell_complete --daemon 2>"$work/daemon.err" &
+daemon_pid=$!
+for _ in $(seq 50); do
+    [[ -S "$SHELL_COMPLETE_SOCKET" ]] && break
+    sleep 0.1
+done
+run_mode daemon
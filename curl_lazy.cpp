@@ -0,0 +1,179 @@
+// Lazy libcurl for the "lazy" build variant (make lazy).
+//
+// Linking libcurl pulls in OpenSSL, nghttp2, Kerberos, LDAP and a few
+// dozen more shared libraries, and the dynamic loader maps and relocates
+// all of them before main() runs, even when the answer then comes from the
+// completion cache or the daemon. This file defines the libcurl functions
+// shell_complete uses and loads the real library with dlopen() on the
+// first call, so a run that never goes to the network never loads it.
+
+// The type-checking macros in curl.h would rename the definitions below
+#define CURL_DISABLE_TYPECHECK
+#include <curl/curl.h>
+#include <dlfcn.h>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+namespace {
+
+void* libcurl = nullptr;
+std::once_flag libcurl_loaded;
+
+void* load_symbol(const char* name) {
+    std::call_once(libcurl_loaded, []() {
+        const char* path = std::getenv("SHELL_COMPLETE_LIBCURL");
+        libcurl = dlopen(path ? path : "libcurl.so.4", RTLD_NOW | RTLD_LOCAL);
+        if (!libcurl) {
+            std::fprintf(stderr, "Failed to load libcurl: %s\n", dlerror());
+            std::exit(1);
+        }
+    });
+    return dlsym(libcurl, name);
+}
+
+}  // namespace
+
+// Resolve name on first use and keep it in a function-local pointer of
+// the type curl.h declares for it
+#define LAZY_CURL(name) \
+    static decltype(&name) real = (decltype(&name))load_symbol(#name)
+
+// All options shell_complete passes through the variadic setters and
+// getters take a single long or pointer argument, which are passed the
+// same way on the LP64 ABIs this variant is built for.
+#define LAZY_CURL_VARIADIC(ret, name, handle_type, option_type)          \
+    extern "C" ret name(handle_type handle, option_type option, ...) {   \
+        LAZY_CURL(name);                                                 \
+        va_list args;                                                    \
+        va_start(args, option);                                          \
+        void* arg = va_arg(args, void*);                                 \
+        va_end(args);                                                    \
+        return real(handle, option, arg);                                \
+    }
+
+LAZY_CURL_VARIADIC(CURLcode, curl_easy_setopt, CURL*, CURLoption)
+LAZY_CURL_VARIADIC(CURLcode, curl_easy_getinfo, CURL*, CURLINFO)
+LAZY_CURL_VARIADIC(CURLSHcode, curl_share_setopt, CURLSH*, CURLSHoption)
+LAZY_CURL_VARIADIC(CURLMcode, curl_multi_setopt, CURLM*, CURLMoption)
+
+extern "C" CURLcode curl_global_init(long flags) {
+    LAZY_CURL(curl_global_init);
+    return real(flags);
+}
+
+extern "C" void curl_global_cleanup(void) {
+    // Nothing to clean up if libcurl was never needed
+    if (!libcurl) return;
+    LAZY_CURL(curl_global_cleanup);
+    real();
+}
+
+extern "C" CURL* curl_easy_init(void) {
+    LAZY_CURL(curl_easy_init);
+    return real();
+}
+
+extern "C" void curl_easy_cleanup(CURL* curl) {
+    LAZY_CURL(curl_easy_cleanup);
+    real(curl);
+}
+
+extern "C" void curl_easy_reset(CURL* curl) {
+    LAZY_CURL(curl_easy_reset);
+    real(curl);
+}
+
+extern "C" CURLcode curl_easy_perform(CURL* curl) {
+    LAZY_CURL(curl_easy_perform);
+    return real(curl);
+}
+
+extern "C" const char* curl_easy_strerror(CURLcode code) {
+    LAZY_CURL(curl_easy_strerror);
+    return real(code);
+}
+
+extern "C" struct curl_slist* curl_slist_append(struct curl_slist* list, const char* text) {
+    LAZY_CURL(curl_slist_append);
+    return real(list, text);
+}
+
+extern "C" void curl_slist_free_all(struct curl_slist* list) {
+    if (!list) return;
+    LAZY_CURL(curl_slist_free_all);
+    real(list);
+}
+
+extern "C" CURLSH* curl_share_init(void) {
+    LAZY_CURL(curl_share_init);
+    return real();
+}
+
+extern "C" CURLSHcode curl_share_cleanup(CURLSH* share) {
+    LAZY_CURL(curl_share_cleanup);
+    return real(share);
+}
+
+extern "C" CURLM* curl_multi_init(void) {
+    LAZY_CURL(curl_multi_init);
+    return real();
+}
+
+extern "C" CURLMcode curl_multi_cleanup(CURLM* multi) {
+    LAZY_CURL(curl_multi_cleanup);
+    return real(multi);
+}
+
+extern "C" CURLMcode curl_multi_add_handle(CURLM* multi, CURL* curl) {
+    LAZY_CURL(curl_multi_add_handle);
+    return real(multi, curl);
+}
+
+extern "C" CURLMcode curl_multi_remove_handle(CURLM* multi, CURL* curl) {
+    LAZY_CURL(curl_multi_remove_handle);
+    return real(multi, curl);
+}
+
+extern "C" CURLMcode curl_multi_perform(CURLM* multi, int* running) {
+    LAZY_CURL(curl_multi_perform);
+    return real(multi, running);
+}
+
+extern "C" CURLMsg* curl_multi_info_read(CURLM* multi, int* queued) {
+    LAZY_CURL(curl_multi_info_read);
+    return real(multi, queued);
+}
+
+extern "C" CURLMcode curl_multi_wait(CURLM* multi, struct curl_waitfd* fds, unsigned int nfds, int timeout_ms,
+                                     int* numfds) {
+    LAZY_CURL(curl_multi_wait);
+    return real(multi, fds, nfds, timeout_ms, numfds);
+}
+
+extern "C" CURLMcode curl_multi_poll(CURLM* multi, struct curl_waitfd* fds, unsigned int nfds, int timeout_ms,
+                                     int* numfds) {
+    LAZY_CURL(curl_multi_poll);
+    return real(multi, fds, nfds, timeout_ms, numfds);
+}
+
+extern "C" CURLMcode curl_multi_wakeup(CURLM* multi) {
+    LAZY_CURL(curl_multi_wakeup);
+    return real(multi);
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+extern "C" CURLcode curl_easy_ssls_import(CURL* curl, const char* session_key, const unsigned char* shmac,
+                                          size_t shmac_len, const unsigned char* sdata, size_t sdata_len) {
+    LAZY_CURL(curl_easy_ssls_import);
+    if (!real) return CURLE_NOT_BUILT_IN;
+    return real(curl, session_key, shmac, shmac_len, sdata, sdata_len);
+}
+
+extern "C" CURLcode curl_easy_ssls_export(CURL* curl, curl_ssls_export_cb* export_fn, void* userptr) {
+    LAZY_CURL(curl_easy_ssls_export);
+    if (!real) return CURLE_NOT_BUILT_IN;
+    return real(curl, export_fn, userptr);
+}
+#endif
@@ -0,0 +1,420 @@
+// Load generator for the completion daemon (make load_test).
+//
+// Starts mock_llm_server and "shell_complete --daemon" pointed at it, then
+// simulates a growing number of shell sessions, one thread each. A
+// session types a command line a key at a time, presses Ctrl+Z and waits
+// for the answer, the way shell_complete.zsh does in asynchronous mode: a
+// new connection per request, provisional=1, and the session's next gen=.
+// Now and then the user types on before the answer arrives and presses
+// Ctrl+Z again, which drops the first connection and cancels its request.
+// Then they think for a while and start on the next command.
+//
+// The daemon is restarted for every step, and each step reports
+// throughput, latency percentiles and the daemon's peak file descriptors,
+// threads, resident memory and open connections to the provider. Run with
+// --help for the settings.
+#define SHELL_COMPLETE_NO_MAIN
+#include "shell_complete.cpp"
+
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/wait.h>
+
+struct LoadOptions {
+    std::vector<int> sessions = {1, 8, 32, 128};
+    // Length of each step
+    int duration_s = 10;
+    // Mean time between key presses and between commands (exponential)
+    double keystroke_ms = 120;
+    double think_ms = 1500;
+    // Share of Ctrl+Z presses followed by more typing and a second Ctrl+Z
+    // before the answer has arrived
+    double retype_rate = 0.2;
+    std::string profile = "typical";
+};
+
+static void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --sessions N,N,...   concurrent sessions per step (default 1,8,32,128)\n"
+              << "  --duration S         seconds per step (default 10)\n"
+              << "  --keystroke-ms N     mean time between key presses (default 120)\n"
+              << "  --think-ms N         mean pause between commands (default 1500)\n"
+              << "  --retype-rate P      share of requests superseded by more typing (default 0.2)\n"
+              << "  --profile NAME       mock_llm_server latency profile (default typical)\n"
+              << "shell_complete and mock_llm_server are taken from the directory of this program." << std::endl;
+}
+
+// What the sessions type; each line gets a random argument so that
+// answers do not come from the daemon's recent completions
+static const char* const load_commands[] = {
+    "git log --oneline",      "grep -rn TODO",         "find . -name",    "docker logs -f",
+    "kubectl get pods -n",    "tar -xzf",              "rsync -av",       "ssh build",
+    "make -j8",               "tail -n 100",           "journalctl -u",   "ps aux | grep",
+    "du -sh",                 "curl -sS",              "cmake --build",   "python3 -m pytest",
+};
+
+// Results of one step, filled in by all sessions
+struct StepResults {
+    std::mutex mutex;
+    std::vector<long long> latency_us;
+    long sent = 0;
+    long ok = 0;
+    long empty = 0;
+    long errors = 0;
+    long connect_failures = 0;
+    long superseded = 0;
+    long provisional = 0;
+};
+
+// Daemon resources, sampled while a step runs
+struct DaemonUsage {
+    long fds = 0;
+    long threads = 0;
+    long rss_kb = 0;
+    long provider_connections = 0;
+};
+
+static std::string program_dir() {
+    char path[4096];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n <= 0) return ".";
+    path[n] = '\0';
+    std::string dir(path);
+    return dir.substr(0, dir.rfind('/'));
+}
+
+// Start a program with stdout and stderr going to the given fds
+static pid_t spawn(const std::vector<std::string>& args, int out_fd, int err_fd) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(err_fd, STDERR_FILENO);
+    std::vector<char*> argv;
+    for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    std::cerr << "Cannot run " << args[0] << ": " << std::strerror(errno) << std::endl;
+    _exit(127);
+}
+
+static void stop(pid_t pid) {
+    if (pid <= 0) return;
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+}
+
+// Start the mock and return its port, or 0
+static int start_mock(const std::string& dir, const std::string& profile, pid_t& pid) {
+    int out[2];
+    if (pipe(out) < 0) return 0;
+    pid = spawn({dir + "/mock_llm_server", "--port", "0", "--profile", profile}, out[1], STDERR_FILENO);
+    close(out[1]);
+    std::string line;
+    char c;
+    while (read(out[0], &c, 1) == 1 && c != '\n') line += c;
+    close(out[0]);
+    size_t colon = line.rfind(':');
+    return colon == std::string::npos ? 0 : std::atoi(line.c_str() + colon + 1);
+}
+
+static pid_t start_daemon(const std::string& dir, const std::string& log_path) {
+    int log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    pid_t pid = spawn({dir + "/shell_complete", "--daemon"}, log_fd, log_fd);
+    close(log_fd);
+    for (int i = 0; i < 100; ++i) {
+        int fd = connect_daemon_socket(daemon_socket_path());
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    stop(pid);
+    return -1;
+}
+
+static long status_field(const std::string& status, const char* name) {
+    size_t pos = status.find(name);
+    return pos == std::string::npos ? 0 : std::atol(status.c_str() + pos + std::strlen(name));
+}
+
+// Established TCP connections to the mock's port, i.e. the daemon's
+// provider connections (the load generator makes none)
+static long count_provider_connections(int port) {
+    std::ifstream tcp("/proc/net/tcp");
+    std::string line;
+    long count = 0;
+    std::getline(tcp, line);
+    while (std::getline(tcp, line)) {
+        std::istringstream fields(line);
+        std::string slot, local, remote, state;
+        fields >> slot >> local >> remote >> state;
+        size_t colon = remote.find(':');
+        if (state == "01" && colon != std::string::npos &&
+            std::strtol(remote.c_str() + colon + 1, nullptr, 16) == port) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+static DaemonUsage sample_daemon(pid_t pid, int mock_port) {
+    DaemonUsage usage;
+    std::string proc = "/proc/" + std::to_string(pid);
+    if (DIR* dir = opendir((proc + "/fd").c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') ++usage.fds;
+        }
+        closedir(dir);
+    }
+    std::ifstream file(proc + "/status");
+    std::string status((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    usage.threads = status_field(status, "Threads:");
+    usage.rss_kb = status_field(status, "VmRSS:");
+    usage.provider_connections = count_provider_connections(mock_port);
+    return usage;
+}
+
+// Sleep for an exponentially distributed time with the given mean, but
+// not past the deadline; false once the deadline has passed
+static bool human_delay(std::mt19937& rng, double mean_ms, std::chrono::steady_clock::time_point deadline) {
+    std::exponential_distribution<double> delay(1.0 / std::max(mean_ms, 0.001));
+    auto until = std::chrono::steady_clock::now() + std::chrono::microseconds((long long)(delay(rng) * 1000));
+    std::this_thread::sleep_until(std::min(until, deadline));
+    return std::chrono::steady_clock::now() < deadline;
+}
+
+// Open a connection and send one COMPLETE; -1 if the daemon is unreachable
+static int send_complete(const std::string& input, const std::string& session, uint64_t generation) {
+    int fd = connect_daemon_socket(daemon_socket_path());
+    if (fd < 0) return -1;
+    timeval timeout = {30, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Frame request;
+    request.verb = "COMPLETE";
+    request.fields.emplace_back("provisional", "1");
+    request.fields.emplace_back("session", session);
+    request.fields.emplace_back("gen", std::to_string(generation));
+    request.payload = input;
+    if (!write_frame(fd, request)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void run_session(int id, const LoadOptions& options, std::chrono::steady_clock::time_point deadline,
+                        StepResults& results) {
+    std::mt19937 rng(id * 7919 + 1);
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::uniform_int_distribution<size_t> pick(0, sizeof(load_commands) / sizeof(load_commands[0]) - 1);
+    std::string session = "load" + std::to_string(getpid()) + "-" + std::to_string(id);
+    uint64_t generation = 0;
+
+    // Sessions do not all start typing at the same moment
+    if (!human_delay(rng, options.think_ms, deadline)) return;
+    for (;;) {
+        std::string line = std::string(load_commands[pick(rng)]) + " w" + std::to_string(rng() % 100000);
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (!human_delay(rng, options.keystroke_ms, deadline)) return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        int fd = send_complete(line, session, ++generation);
+        long superseded = 0;
+        if (fd >= 0 && chance(rng) < options.retype_rate) {
+            // A couple more keys, then Ctrl+Z again; the plugin just closes
+            // the old connection and the daemon cancels that request
+            human_delay(rng, 2 * options.keystroke_ms, std::chrono::steady_clock::time_point::max());
+            close(fd);
+            superseded = 1;
+            line += " -v";
+            start = std::chrono::steady_clock::now();
+            fd = send_complete(line, session, ++generation);
+        }
+
+        bool ok = false, empty = false, error = false, provisional = false;
+        if (fd >= 0) {
+            FrameReader reader(fd);
+            Frame response;
+            while (reader.read_frame(response)) {
+                if (response.verb == "PROVISIONAL") {
+                    provisional = true;
+                    continue;
+                }
+                ok = response.verb == "OK" && !response.payload.empty();
+                empty = response.verb == "OK" && response.payload.empty();
+                break;
+            }
+            error = !ok && !empty;
+            close(fd);
+        }
+        long long us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start)
+                           .count();
+        {
+            std::lock_guard<std::mutex> lock(results.mutex);
+            results.sent += 1 + superseded;
+            results.superseded += superseded;
+            if (fd < 0) {
+                ++results.connect_failures;
+            } else {
+                if (ok) results.latency_us.push_back(us);
+                results.ok += ok;
+                results.empty += empty;
+                results.errors += error;
+                results.provisional += provisional;
+            }
+        }
+
+        if (!human_delay(rng, options.think_ms, deadline)) return;
+    }
+}
+
+static double percentile_ms(const std::vector<long long>& sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t i = (size_t)(q * sorted.size() + 0.999999);
+    return sorted[std::max<size_t>(i, 1) - 1] / 1000.0;
+}
+
+static int remove_entry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--help" || arg == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        ++i;
+        if (arg == "--sessions") {
+            options.sessions.clear();
+            std::istringstream list(value);
+            std::string n;
+            while (std::getline(list, n, ',')) {
+                if (std::atoi(n.c_str()) > 0) options.sessions.push_back(std::atoi(n.c_str()));
+            }
+        } else if (arg == "--duration") {
+            options.duration_s = std::max(1, std::atoi(value));
+        } else if (arg == "--keystroke-ms") {
+            options.keystroke_ms = std::atof(value);
+        } else if (arg == "--think-ms") {
+            options.think_ms = std::atof(value);
+        } else if (arg == "--retype-rate") {
+            options.retype_rate = std::atof(value);
+        } else if (arg == "--profile") {
+            options.profile = value;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    char work_template[] = "/tmp/shell_complete_load.XXXXXX";
+    if (!mkdtemp(work_template)) {
+        std::cerr << "mkdtemp: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::string work = work_template;
+    std::string dir = program_dir();
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t mock_pid = -1;
+    int mock_port = start_mock(dir, options.profile, mock_pid);
+    if (mock_port <= 0) {
+        std::cerr << "mock_llm_server did not start" << std::endl;
+        stop(mock_pid);
+        nftw(work.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+
+    // The daemon inherits these: everything it keeps goes to the scratch
+    // directory, and the completion cache is off so requests reach the mock
+    std::string origin = "http://127.0.0.1:" + std::to_string(mock_port) + "/";
+    setenv("CEREBRAS_API_KEY", "load", 1);
+    setenv("ANTHROPIC_API_KEY", "load", 1);
+    setenv("SHELL_COMPLETE_CEREBRAS_URL", origin.c_str(), 1);
+    setenv("SHELL_COMPLETE_ANTHROPIC_URL", origin.c_str(), 1);
+    setenv("SHELL_COMPLETE_CACHE", "0", 1);
+    setenv("SHELL_COMPLETE_SOCKET", (work + "/daemon.sock").c_str(), 1);
+    setenv("XDG_CACHE_HOME", (work + "/cache").c_str(), 1);
+    setenv("XDG_STATE_HOME", (work + "/state").c_str(), 1);
+    unsetenv("SHELL_COMPLETE_PROVIDER");
+    unsetenv("SHELL_COMPLETE_HEDGE_MS");
+
+    std::cout << "mock profile " << options.profile << ", " << options.duration_s << " s per step, keystroke "
+              << options.keystroke_ms << " ms, think " << options.think_ms << " ms, retype rate "
+              << options.retype_rate << "\n\n";
+    std::printf("%8s %8s %7s %6s %6s %9s %8s %8s %8s %8s  %6s %7s %8s %9s\n", "sessions", "requests", "req/s",
+                "failed", "cancel", "provis", "p50 ms", "p90 ms", "p99 ms", "max ms", "fds", "threads", "rss MB",
+                "provider");
+
+    int status = 0;
+    for (int sessions : options.sessions) {
+        pid_t daemon_pid = start_daemon(dir, work + "/daemon.log");
+        if (daemon_pid < 0) {
+            // The scratch directory goes away below, so show the log now
+            std::ifstream log(work + "/daemon.log");
+            std::cerr << "shell_complete --daemon did not start" << std::endl;
+            if (log.peek() != std::ifstream::traits_type::eof()) std::cerr << log.rdbuf() << std::endl;
+            status = 1;
+            break;
+        }
+
+        StepResults results;
+        DaemonUsage peak;
+        std::atomic<bool> running(true);
+        std::thread monitor([&]() {
+            while (running) {
+                DaemonUsage now = sample_daemon(daemon_pid, mock_port);
+                peak.fds = std::max(peak.fds, now.fds);
+                peak.threads = std::max(peak.threads, now.threads);
+                peak.rss_kb = std::max(peak.rss_kb, now.rss_kb);
+                peak.provider_connections = std::max(peak.provider_connections, now.provider_connections);
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::seconds(options.duration_s);
+        std::vector<std::thread> threads;
+        for (int id = 0; id < sessions; ++id) {
+            threads.emplace_back(run_session, id, std::cref(options), deadline, std::ref(results));
+        }
+        for (auto& thread : threads) thread.join();
+        // Requests still in flight at the deadline count toward the wall time
+        double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        running = false;
+        monitor.join();
+
+        // Peak resident size over the whole step, not just the samples
+        std::ifstream file("/proc/" + std::to_string(daemon_pid) + "/status");
+        std::string proc_status((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        peak.rss_kb = std::max(peak.rss_kb, status_field(proc_status, "VmHWM:"));
+        stop(daemon_pid);
+
+        std::sort(results.latency_us.begin(), results.latency_us.end());
+        long failed = results.empty + results.errors + results.connect_failures;
+        std::printf("%8d %8ld %7.1f %6ld %6ld %9ld %8.1f %8.1f %8.1f %8.1f  %6ld %7ld %8.1f %9ld\n", sessions,
+                    results.sent, results.ok / wall_s, failed, results.superseded, results.provisional,
+                    percentile_ms(results.latency_us, 0.5), percentile_ms(results.latency_us, 0.9),
+                    percentile_ms(results.latency_us, 0.99), percentile_ms(results.latency_us, 1.0), peak.fds,
+                    peak.threads, peak.rss_kb / 1024.0, peak.provider_connections);
+        std::fflush(stdout);
+        if (results.connect_failures > 0) {
+            std::cout << "         " << results.connect_failures << " requests could not connect to the daemon"
+                      << std::endl;
+        }
+    }
+
+    stop(mock_pid);
+    nftw(work.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
@@ -0,0 +1,439 @@
+// Mock LLM API for offline tests and benchmarks.
+//
+// Serves the two endpoints shell_complete talks to, on localhost over
+// HTTP/1.1 with keep-alive:
+//   POST /v1/chat/completions   OpenAI-compatible (Cerebras)
+//   POST /v1/messages           Anthropic Messages
+// both plain JSON and server-sent events ("stream": true), and answers
+// anything else (such as the HEAD request used for prewarming) with 404.
+//
+// The completion is the request's input followed by " --mock", cut into
+// tokens of a few characters. Latency, errors and rate limiting are set
+// on the command line; see usage() or run with --help.
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <unistd.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+struct Options {
+    int port = 8765;
+    // Time from the request to the response headers
+    long ttfb_ms = 150;
+    // Streaming speed; 0 sends all tokens at once
+    double tokens_per_sec = 300;
+    // Uniform random extra delay added to the TTFB, 0..jitter_ms
+    long jitter_ms = 30;
+    // Share of requests answered with a server error (500 / Anthropic 529)
+    double error_rate = 0;
+    // Requests per minute before answering 429; 0 for no limit
+    long rate_limit = 0;
+};
+
+static void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --port N             listen on 127.0.0.1:N (default 8765, 0 picks one)\n"
+              << "  --profile NAME       preset: fast, typical (default), slow, flaky\n"
+              << "  --ttfb-ms N          time to first byte\n"
+              << "  --tokens-per-sec N   streaming speed (0 = all at once)\n"
+              << "  --jitter-ms N        random extra TTFB, up to N ms\n"
+              << "  --error-rate P       share of requests that fail with a server error\n"
+              << "  --rate-limit N       requests per minute before answering 429\n"
+              << "Options apply in order, so a profile can be adjusted by later options." << std::endl;
+}
+
+static bool apply_profile(const std::string& name, Options& options) {
+    if (name == "fast") {
+        options.ttfb_ms = 20;
+        options.tokens_per_sec = 2000;
+        options.jitter_ms = 5;
+    } else if (name == "typical") {
+        options.ttfb_ms = 150;
+        options.tokens_per_sec = 300;
+        options.jitter_ms = 30;
+    } else if (name == "slow") {
+        options.ttfb_ms = 800;
+        options.tokens_per_sec = 50;
+        options.jitter_ms = 200;
+    } else if (name == "flaky") {
+        options.ttfb_ms = 150;
+        options.tokens_per_sec = 300;
+        options.jitter_ms = 300;
+        options.error_rate = 0.05;
+        options.rate_limit = 600;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static Options options;
+
+// Sliding one-minute window of accepted requests, for --rate-limit
+class RateLimiter {
+public:
+    // True if the request may proceed; sets remaining and reset_seconds
+    // for the rate-limit headers either way
+    bool admit(long limit, long& remaining, long& reset_seconds) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        while (!accepted_.empty() && now - accepted_.front() >= std::chrono::minutes(1)) accepted_.pop_front();
+        bool ok = limit <= 0 || (long)accepted_.size() < limit;
+        if (ok) accepted_.push_back(now);
+        remaining = limit <= 0 ? 1000000 : limit - (long)accepted_.size();
+        reset_seconds = accepted_.empty() ? 0
+                                          : 60 - std::chrono::duration_cast<std::chrono::seconds>(
+                                                     now - accepted_.front()).count();
+        return ok;
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<std::chrono::steady_clock::time_point> accepted_;
+};
+
+static RateLimiter rate_limiter;
+
+static std::mutex rng_mutex;
+static std::mt19937 rng(std::random_device{}());
+
+static double uniform() {
+    std::lock_guard<std::mutex> lock(rng_mutex);
+    return std::uniform_real_distribution<double>(0, 1)(rng);
+}
+
+static bool send_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+static bool send_chunk(int fd, const std::string& data) {
+    char size[32];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    return send_all(fd, size + data + "\r\n");
+}
+
+static std::string json_escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out;
+}
+
+// The user's input from the request body: the last "content" string,
+// which is the user message in both formats, without the "Input: ...\n
+// Output:" framing the OpenAI-style prompt puts around it
+static std::string request_input(const std::string& body) {
+    size_t start = body.rfind("\"content\":\"");
+    if (start == std::string::npos) return "echo";
+    std::string text;
+    for (size_t i = start + 11; i < body.size() && body[i] != '"'; ++i) {
+        if (body[i] == '\\' && i + 1 < body.size()) {
+            char c = body[++i];
+            text += c == 'n' ? '\n' : c == 't' ? '\t' : c;
+        } else {
+            text += body[i];
+        }
+    }
+    if (text.compare(0, 7, "Input: ") == 0) text = text.substr(7, text.find('\n') - 7);
+    return text;
+}
+
+static std::vector<std::string> tokenize(const std::string& text) {
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < text.size(); i += 4) tokens.push_back(text.substr(i, 4));
+    return tokens;
+}
+
+struct Request {
+    std::string method;
+    std::string path;
+    std::string body;
+    bool keep_alive = true;
+};
+
+// Read one request from fd, with buffer holding bytes read past the
+// previous one. False on EOF or a malformed request.
+static bool read_request(int fd, std::string& buffer, Request& request) {
+    size_t header_end;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || buffer.size() > 65536) return false;
+        buffer.append(chunk, n);
+    }
+    std::string head = buffer.substr(0, header_end);
+    buffer.erase(0, header_end + 4);
+
+    size_t line_end = head.find("\r\n");
+    std::string request_line = head.substr(0, line_end);
+    size_t space1 = request_line.find(' ');
+    size_t space2 = request_line.find(' ', space1 + 1);
+    if (space1 == std::string::npos || space2 == std::string::npos) return false;
+    request.method = request_line.substr(0, space1);
+    request.path = request_line.substr(space1 + 1, space2 - space1 - 1);
+    request.keep_alive = true;
+
+    size_t content_length = 0;
+    bool expect_continue = false;
+    size_t pos = line_end;
+    while (pos != std::string::npos && pos < head.size()) {
+        size_t next = head.find("\r\n", pos + 2);
+        std::string line = head.substr(pos + 2, next == std::string::npos ? std::string::npos : next - pos - 2);
+        pos = next;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string name = line.substr(0, colon);
+        for (char& c : name) c = (char)tolower((unsigned char)c);
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        if (name == "content-length") content_length = std::strtoul(value.c_str(), nullptr, 10);
+        if (name == "connection" && strcasecmp(value.c_str(), "close") == 0) request.keep_alive = false;
+        if (name == "expect" && strcasecmp(value.c_str(), "100-continue") == 0) expect_continue = true;
+    }
+
+    if (expect_continue && buffer.size() < content_length && !send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n")) {
+        return false;
+    }
+    while (buffer.size() < content_length) {
+        char chunk[16384];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+    }
+    request.body = buffer.substr(0, content_length);
+    buffer.erase(0, content_length);
+    return true;
+}
+
+static bool send_response(int fd, int status, const char* reason, const std::string& headers,
+                          const std::string& body, const std::string& content_type = "application/json") {
+    std::string response = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n" +
+                           "Content-Type: " + content_type + "\r\n" +
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+    return send_all(fd, response);
+}
+
+static void sleep_ms(double ms) {
+    if (ms > 0) std::this_thread::sleep_for(std::chrono::microseconds((long long)(ms * 1000)));
+}
+
+// Answer one API request. Returns false if the connection is unusable.
+static bool serve_completion(int fd, const Request& request, bool anthropic) {
+    long remaining, reset_seconds;
+    bool admitted = rate_limiter.admit(options.rate_limit, remaining, reset_seconds);
+    std::string headers;
+    if (anthropic) {
+        headers += "anthropic-ratelimit-requests-remaining: " + std::to_string(remaining) + "\r\n";
+        headers += "anthropic-ratelimit-requests-reset: " + std::to_string(reset_seconds) + "s\r\n";
+    } else {
+        headers += "x-ratelimit-remaining-requests-minute: " + std::to_string(remaining) + "\r\n";
+        headers += "x-ratelimit-reset-requests-minute: " + std::to_string(reset_seconds) + "\r\n";
+    }
+
+    sleep_ms(options.ttfb_ms + uniform() * options.jitter_ms);
+
+    if (!admitted) {
+        headers += "retry-after: " + std::to_string(std::max(1L, reset_seconds)) + "\r\n";
+        return send_response(fd, 429, "Too Many Requests", headers,
+                             "{\"error\":{\"type\":\"rate_limit_error\",\"message\":\"mock rate limit\"}}");
+    }
+    if (uniform() < options.error_rate) {
+        if (anthropic) {
+            return send_response(fd, 529, "Overloaded", headers,
+                                 "{\"type\":\"error\",\"error\":{\"type\":\"overloaded_error\",\"message\":\"mock\"}}");
+        }
+        return send_response(fd, 500, "Internal Server Error", headers,
+                             "{\"error\":{\"type\":\"server_error\",\"message\":\"mock\"}}");
+    }
+
+    std::string text = request_input(request.body) + " --mock";
+    std::vector<std::string> tokens = tokenize(text);
+    long input_tokens = (long)request.body.size() / 4;
+    long output_tokens = (long)tokens.size();
+    bool stream = request.body.find("\"stream\":true") != std::string::npos;
+
+    if (!stream) {
+        std::string body;
+        if (anthropic) {
+            body = "{\"type\":\"message\",\"role\":\"assistant\",\"content\":[{\"type\":\"text\",\"text\":\"" +
+                   json_escape(text) + "\"}],\"stop_reason\":\"end_turn\",\"usage\":{\"input_tokens\":" +
+                   std::to_string(input_tokens) + ",\"output_tokens\":" + std::to_string(output_tokens) + "}}";
+        } else {
+            body = "{\"object\":\"chat.completion\",\"choices\":[{\"index\":0,\"message\":{\"role\":\"assistant\","
+                   "\"content\":\"" + json_escape(text) + "\"},\"finish_reason\":\"stop\"}],\"usage\":"
+                   "{\"prompt_tokens\":" + std::to_string(input_tokens) + ",\"completion_tokens\":" +
+                   std::to_string(output_tokens) + "}}";
+        }
+        sleep_ms(options.tokens_per_sec > 0 ? tokens.size() * 1000.0 / options.tokens_per_sec : 0);
+        return send_response(fd, 200, "OK", headers, body);
+    }
+
+    if (!send_all(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                      "Transfer-Encoding: chunked\r\n" + headers + "\r\n")) {
+        return false;
+    }
+    double token_ms = options.tokens_per_sec > 0 ? 1000.0 / options.tokens_per_sec : 0;
+    // The client hangs up once it has the whole command; that is fine
+    if (anthropic) {
+        if (!send_chunk(fd, "event: message_start\ndata: {\"type\":\"message_start\",\"message\":{\"role\":"
+                            "\"assistant\",\"usage\":{\"input_tokens\":" + std::to_string(input_tokens) +
+                            ",\"output_tokens\":1}}}\n\n"
+                            "event: content_block_start\ndata: {\"type\":\"content_block_start\",\"index\":0,"
+                            "\"content_block\":{\"type\":\"text\",\"text\":\"\"}}\n\n")) {
+            return false;
+        }
+        for (const std::string& token : tokens) {
+            if (!send_chunk(fd, "event: content_block_delta\ndata: {\"type\":\"content_block_delta\",\"index\":0,"
+                                "\"delta\":{\"type\":\"text_delta\",\"text\":\"" + json_escape(token) + "\"}}\n\n")) {
+                return false;
+            }
+            sleep_ms(token_ms);
+        }
+        if (!send_chunk(fd, "event: content_block_stop\ndata: {\"type\":\"content_block_stop\",\"index\":0}\n\n"
+                            "event: message_delta\ndata: {\"type\":\"message_delta\",\"delta\":{\"stop_reason\":"
+                            "\"end_turn\"},\"usage\":{\"output_tokens\":" + std::to_string(output_tokens) + "}}\n\n"
+                            "event: message_stop\ndata: {\"type\":\"message_stop\"}\n\n")) {
+            return false;
+        }
+    } else {
+        for (const std::string& token : tokens) {
+            if (!send_chunk(fd, "data: {\"object\":\"chat.completion.chunk\",\"choices\":[{\"index\":0,\"delta\":"
+                                "{\"content\":\"" + json_escape(token) + "\"}}]}\n\n")) {
+                return false;
+            }
+            sleep_ms(token_ms);
+        }
+        if (!send_chunk(fd, "data: {\"object\":\"chat.completion.chunk\",\"choices\":[{\"index\":0,\"delta\":{},"
+                            "\"finish_reason\":\"stop\"}],\"usage\":{\"prompt_tokens\":" +
+                            std::to_string(input_tokens) + ",\"completion_tokens\":" +
+                            std::to_string(output_tokens) + "}}\n\ndata: [DONE]\n\n")) {
+            return false;
+        }
+    }
+    return send_all(fd, "0\r\n\r\n");
+}
+
+static void serve_connection(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::string buffer;
+    Request request;
+    while (read_request(fd, buffer, request)) {
+        bool ok;
+        if (request.method == "POST" && request.path == "/v1/chat/completions") {
+            ok = serve_completion(fd, request, false);
+        } else if (request.method == "POST" && request.path == "/v1/messages") {
+            ok = serve_completion(fd, request, true);
+        } else if (request.method == "HEAD") {
+            ok = send_all(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        } else {
+            ok = send_response(fd, 404, "Not Found", "", "{\"error\":{\"message\":\"not found\"}}");
+        }
+        if (!ok || !request.keep_alive) break;
+    }
+    close(fd);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--help" || arg == "-h") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        ++i;
+        if (arg == "--port") {
+            options.port = std::atoi(value);
+        } else if (arg == "--profile") {
+            if (!apply_profile(value, options)) {
+                std::cerr << "Unknown profile: " << value << std::endl;
+                return 1;
+            }
+        } else if (arg == "--ttfb-ms") {
+            options.ttfb_ms = std::atol(value);
+        } else if (arg == "--tokens-per-sec") {
+            options.tokens_per_sec = std::atof(value);
+        } else if (arg == "--jitter-ms") {
+            options.jitter_ms = std::atol(value);
+        } else if (arg == "--error-rate") {
+            options.error_rate = std::atof(value);
+        } else if (arg == "--rate-limit") {
+            options.rate_limit = std::atol(value);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)options.port);
+    if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 512) < 0) {
+        std::cerr << "Cannot listen on port " << options.port << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    socklen_t length = sizeof(addr);
+    getsockname(listener, (sockaddr*)&addr, &length);
+    // Scripts read the port from here when started with --port 0
+    std::cout << "mock_llm_server listening on http://127.0.0.1:" << ntohs(addr.sin_port) << "/" << std::endl;
+
+    for (;;) {
+        int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "accept: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        std::thread(serve_connection, fd).detach();
+    }
+}
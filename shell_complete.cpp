@@ -2,181 +2,4687 @@
 #include <string>
 #include <sstream>
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <ctime>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#if defined(__linux__)
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 #include <curl/curl.h>
 #include "json.hpp"
 
 using json = nlohmann::json;
 
-// Callback for libcurl to write response data
-size_t write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+// Largest non-SSE response body kept for error reporting
+static const size_t MAX_ERROR_BODY = 64 * 1024;
+
+// Called with each piece of completion text as it arrives
+typedef std::function<void(const std::string&)> ChunkCallback;
+
+// Lets a newer request from the same shell abandon an older one that is
+// still in flight. The daemon hands one out per request (see
+// SessionGenerations); the default token is never cancelled.
+class CancelToken {
+public:
+    CancelToken() : generation_(0) {}
+    CancelToken(std::shared_ptr<std::atomic<uint64_t>> latest, uint64_t generation)
+        : latest_(latest), generation_(generation) {}
+
+    bool cancelled() const { return latest_ && latest_->load() > generation_; }
+    explicit operator bool() const { return (bool)latest_; }
+
+private:
+    std::shared_ptr<std::atomic<uint64_t>> latest_;
+    uint64_t generation_;
+};
+
+// Incremental parser for text/event-stream bodies. Bytes are fed as curl
+// delivers them; every complete event (terminated by a blank line) is
+// handed to on_event with its event name and joined data lines. Lines are
+// parsed where they lie in curl's buffer, and only one split across two
+// deliveries is copied; the buffers are reused, so a warmed parser does
+// not allocate.
+class SseParser {
+public:
+    typedef std::function<void(const std::string& event, const std::string& data)> EventCallback;
+
+    explicit SseParser(EventCallback on_event) : on_event_(on_event) {}
+
+    bool saw_event() const { return saw_event_; }
+
+    void feed(const char* data, size_t len) {
+        const char* end = data + len;
+        while (data < end) {
+            const char* newline = (const char*)std::memchr(data, '\n', end - data);
+            if (!newline) {
+                line_.append(data, end);
+                return;
+            }
+            if (line_.empty()) {
+                process_line(data, newline);
+            } else {
+                line_.append(data, newline);
+                process_line(line_.data(), line_.data() + line_.size());
+                line_.clear();
+            }
+            data = newline + 1;
+        }
+    }
+
+private:
+    static bool field_is(const char* begin, const char* end, const char* name) {
+        size_t len = std::strlen(name);
+        return (size_t)(end - begin) == len && std::memcmp(begin, name, len) == 0;
+    }
+
+    void process_line(const char* begin, const char* end) {
+        if (end > begin && end[-1] == '\r') --end;
+        if (begin == end) {
+            // Blank line: dispatch the event collected so far
+            static const std::string message = "message";
+            if (has_data_) {
+                saw_event_ = true;
+                on_event_(event_.empty() ? message : event_, data_);
+            }
+            event_.clear();
+            data_.clear();
+            has_data_ = false;
+            return;
+        }
+        if (*begin == ':') return;  // comment / keep-alive
+
+        const char* colon = (const char*)std::memchr(begin, ':', end - begin);
+        const char* field_end = colon ? colon : end;
+        const char* value = colon ? colon + 1 : end;
+        if (value < end && *value == ' ') ++value;
+
+        if (field_is(begin, field_end, "event")) {
+            event_.assign(value, end);
+        } else if (field_is(begin, field_end, "data")) {
+            if (has_data_) data_ += '\n';
+            data_.append(value, end);
+            has_data_ = true;
+        }
+    }
+
+    EventCallback on_event_;
+    // The start of a line whose end has not arrived yet
+    std::string line_;
+    std::string event_;
+    std::string data_;
+    bool has_data_ = false;
+    bool saw_event_ = false;
+};
+
+// Minimal shell lexer used to decide when streamed output already holds one
+// complete command line: a newline that is not inside quotes, a comment, a
+// heredoc body, an open parenthesis, a backslash continuation or after a
+// trailing pipe/&& operator.
+class ShellLexer {
+public:
+    // Feed one character; returns true if it is the newline that ends the
+    // first complete command
+    bool feed(char c) {
+        switch (state_) {
+        case SINGLE:
+            if (c == '\'') state_ = NORMAL;
+            return false;
+        case DOUBLE:
+        case ANSI_C:
+            if (escape_) {
+                escape_ = false;
+            } else if (c == '\\') {
+                escape_ = true;
+            } else if (c == (state_ == DOUBLE ? '"' : '\'')) {
+                state_ = NORMAL;
+            }
+            return false;
+        case COMMENT:
+            if (c != '\n') return false;
+            state_ = NORMAL;
+            return end_of_line();
+        case HEREDOC_OP:
+            if (c == '-' && !strip_tabs_) {
+                strip_tabs_ = true;
+                return false;
+            }
+            if (c == ' ' || c == '\t') return false;
+            state_ = HEREDOC_WORD;
+            heredoc_word_.clear();
+            word_quote_ = 0;
+            return feed(c);
+        case HEREDOC_WORD:
+            if (word_quote_) {
+                if (c == word_quote_) word_quote_ = 0;
+                else heredoc_word_ += c;
+                return false;
+            }
+            if (c == '\'' || c == '"') {
+                word_quote_ = c;
+                return false;
+            }
+            if (c == '\\') return false;
+            if (std::strchr(" \t\n;|&<>()", c)) {
+                pending_.push_back(Heredoc{heredoc_word_, strip_tabs_});
+                state_ = NORMAL;
+                return feed(c);
+            }
+            heredoc_word_ += c;
+            return false;
+        case HEREDOC_BODY:
+            if (c != '\n') {
+                body_line_ += c;
+                return false;
+            }
+            {
+                size_t start = 0;
+                if (pending_.front().strip_tabs) {
+                    while (start < body_line_.size() && body_line_[start] == '\t') ++start;
+                }
+                bool closes = body_line_.compare(start, std::string::npos, pending_.front().delimiter) == 0;
+                body_line_.clear();
+                if (!closes) return false;
+                pending_.erase(pending_.begin());
+                if (!pending_.empty()) return false;
+                state_ = NORMAL;
+                return !continued_after_heredoc_;
+            }
+        case NORMAL:
+            break;
+        }
+
+        if (escape_) {
+            escape_ = false;
+            if (c != '\n') mark_content(c);
+            return false;
+        }
+        if (lt_run_ == 2 && c != '<') {
+            lt_run_ = 0;
+            strip_tabs_ = false;
+            state_ = HEREDOC_OP;
+            return feed(c);
+        }
+        lt_run_ = (c == '<') ? lt_run_ + 1 : 0;
+
+        switch (c) {
+        case '\\':
+            escape_ = true;
+            return false;
+        case '\'':
+            state_ = (last_ == '$') ? ANSI_C : SINGLE;
+            break;
+        case '"':
+            state_ = DOUBLE;
+            break;
+        case '#':
+            if (last_ == 0 || std::strchr(" \t\n;|&()", last_)) {
+                state_ = COMMENT;
+                return false;
+            }
+            break;
+        case '(':
+            ++depth_;
+            break;
+        case ')':
+            if (depth_ > 0) --depth_;
+            break;
+        case '\n':
+            return end_of_line();
+        }
+        if (c != ' ' && c != '\t') mark_content(c);
+        else last_ = c;
+        return false;
+    }
+
+private:
+    enum State { NORMAL, SINGLE, DOUBLE, ANSI_C, COMMENT, HEREDOC_OP, HEREDOC_WORD, HEREDOC_BODY };
+
+    struct Heredoc {
+        std::string delimiter;
+        bool strip_tabs;
+    };
+
+    void mark_content(char c) {
+        has_content_ = true;
+        prev_sig_ = sig_;
+        sig_ = c;
+        last_ = c;
+    }
+
+    // Unquoted newline: does it end the command?
+    bool end_of_line() {
+        last_ = '\n';
+        if (!has_content_) return false;  // leading blank lines
+        bool continues = depth_ > 0 || sig_ == '|' || (sig_ == '&' && prev_sig_ == '&');
+        if (!pending_.empty()) {
+            continued_after_heredoc_ = continues;
+            state_ = HEREDOC_BODY;
+            return false;
+        }
+        return !continues;
+    }
+
+    State state_ = NORMAL;
+    bool escape_ = false;
+    bool has_content_ = false;
+    bool strip_tabs_ = false;
+    bool continued_after_heredoc_ = false;
+    char last_ = 0;
+    char sig_ = 0;
+    char prev_sig_ = 0;
+    char word_quote_ = 0;
+    int lt_run_ = 0;
+    int depth_ = 0;
+    std::string heredoc_word_;
+    std::string body_line_;
+    std::vector<Heredoc> pending_;
+};
+
+// Stop sequences from SHELL_COMPLETE_STOP (comma separated). They are sent
+// to the provider and also enforced locally on the streamed text.
+std::vector<std::string> configured_stop_sequences() {
+    std::vector<std::string> stops;
+    const char* env = std::getenv("SHELL_COMPLETE_STOP");
+    if (!env) return stops;
+    std::stringstream ss(env);
+    std::string stop;
+    while (std::getline(ss, stop, ',')) {
+        if (!stop.empty()) stops.push_back(stop);
+    }
+    return stops;
+}
+
+// Collects streamed text and finishes as soon as one complete command line
+// (per ShellLexer) or a stop sequence has arrived. Only text before that
+// point is passed on to on_chunk or returned.
+class CompletionBuilder {
+public:
+    CompletionBuilder(const std::vector<std::string>& stops, const ChunkCallback& on_chunk)
+        : stops_(stops), on_chunk_(on_chunk) {}
+
+    void add(const std::string& piece) {
+        if (done_) return;
+        for (char c : piece) {
+            // Leading whitespace is never part of the command
+            if (text_.empty() && (c == ' ' || c == '\t' || c == '\n' || c == '\r')) continue;
+            if (lexer_.feed(c)) {
+                done_ = true;
+                break;
+            }
+            text_ += c;
+        }
+        for (const auto& stop : stops_) {
+            size_t pos = text_.find(stop, scanned_ > stop.size() ? scanned_ - stop.size() : 0);
+            if (pos != std::string::npos) {
+                text_.resize(pos);
+                done_ = true;
+            }
+        }
+        scanned_ = text_.size();
+        emit(done_ ? text_.size() : safe_length());
+    }
+
+    // The stream ended on its own: pass on whatever was held back
+    void finish() {
+        emit(text_.size());
+    }
+
+    bool done() const { return done_; }
+
+    std::string text() const {
+        size_t end = text_.find_last_not_of(" \t\r\n");
+        return end == std::string::npos ? "" : text_.substr(0, end + 1);
+    }
+
+private:
+    // Hold back a tail that could still turn into a stop sequence
+    size_t safe_length() const {
+        size_t hold = 0;
+        for (const auto& stop : stops_) {
+            for (size_t n = std::min(stop.size() - 1, text_.size()); n > hold; --n) {
+                if (text_.compare(text_.size() - n, n, stop, 0, n) == 0) {
+                    hold = n;
+                    break;
+                }
+            }
+        }
+        return text_.size() - hold;
+    }
+
+    void emit(size_t upto) {
+        if (upto <= emitted_) return;
+        if (on_chunk_) {
+            chunk_.assign(text_, emitted_, upto - emitted_);
+            on_chunk_(chunk_);
+        }
+        emitted_ = upto;
+    }
+
+    std::vector<std::string> stops_;
+    ChunkCallback on_chunk_;
+    ShellLexer lexer_;
+    std::string text_;
+    // Reused for each piece passed to on_chunk
+    std::string chunk_;
+    size_t emitted_ = 0;
+    size_t scanned_ = 0;
+    bool done_ = false;
+};
+
+long long steady_ns();
+
+// Part of a response as it arrived, kept while recording fixtures
+struct RecordedChunk {
+    long long at_ns;  // steady_ns()
+    std::string data;
+};
+
+// Write target for a streaming request. The raw body is kept only until
+// the first SSE event, so a plain JSON error response can still be read.
+struct StreamingResponse {
+    explicit StreamingResponse(SseParser::EventCallback on_event) : parser(on_event) {}
+
+    SseParser parser;
+    std::string body;
+    CompletionBuilder* builder = nullptr;
+    // Set from whichever thread runs the transfer (see Transport)
+    std::atomic<bool> got_data{false};
+    // Everything received, when recording (see HttpFixtures)
+    bool record = false;
+    std::vector<RecordedChunk> recorded;
+};
+
+// Callback for libcurl to feed a streaming response into its SSE parser.
+// Returning short aborts the transfer once the completion is finished.
+size_t stream_write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
     size_t total_size = size * nmemb;
-    ((std::string*)userp)->append((char*)contents, total_size);
+    StreamingResponse* stream = (StreamingResponse*)userp;
+    stream->got_data = true;
+    if (stream->record) stream->recorded.push_back(RecordedChunk{steady_ns(), std::string((char*)contents, total_size)});
+    stream->parser.feed((char*)contents, total_size);
+    if (!stream->parser.saw_event() && stream->body.size() < MAX_ERROR_BODY) {
+        stream->body.append((char*)contents, total_size);
+    }
+    if (stream->builder && stream->builder->done()) {
+        return 0;
+    }
     return total_size;
 }
 
-std::string call_llm_cerebras(const std::string& command_line) {
-    const char* api_key = std::getenv("CEREBRAS_API_KEY");
-    if (!api_key) {
-        std::cerr << "Error: CEREBRAS_API_KEY not set" << std::endl;
+enum Provider {
+    PROVIDER_CEREBRAS = 0,
+    PROVIDER_ANTHROPIC = 1,
+    PROVIDER_COUNT
+};
+
+const char* provider_name(Provider provider) {
+    return provider == PROVIDER_ANTHROPIC ? "anthropic" : "cerebras";
+}
+
+// Origin from the environment variable name, or fallback; always ends in "/"
+static std::string origin_from_env(const char* name, const char* fallback) {
+    const char* env = std::getenv(name);
+    std::string origin = env && *env ? env : fallback;
+    if (origin.back() != '/') origin += '/';
+    return origin;
+}
+
+// Scheme and host of the provider's API, without a path.
+// SHELL_COMPLETE_CEREBRAS_URL and SHELL_COMPLETE_ANTHROPIC_URL point a
+// provider somewhere else, such as mock_llm_server.
+const char* provider_origin(Provider provider) {
+    static const std::string origins[PROVIDER_COUNT] = {
+        origin_from_env("SHELL_COMPLETE_CEREBRAS_URL", "https://api.cerebras.ai/"),
+        origin_from_env("SHELL_COMPLETE_ANTHROPIC_URL", "https://api.anthropic.com/"),
+    };
+    return origins[provider].c_str();
+}
+
+long long steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long long steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Taken during static initialization, once the dynamic loader is done
+static const long long process_init_ns = steady_ns();
+
+// How one finished transfer went. The phase times are libcurl's, measured
+// from the start of the transfer: name lookup, TCP connect, TLS handshake,
+// request sent (pretransfer), first response byte, and done. Unknown
+// values are -1.
+struct TransferTiming {
+    const char* provider = "";
+    bool ok = false;
+    curl_off_t dns_us = -1, connect_us = -1, tls_us = -1, pretransfer_us = -1, first_byte_us = -1, total_us = -1;
+    // Until the first piece of completion text was decoded
+    long long first_token_us = -1;
+    long input_tokens = -1, output_tokens = -1;
+};
+
+// --timing json: one JSON object per finished transfer on stderr
+static bool timing_json = false;
+
+void print_timing_json(const TransferTiming& t) {
+    auto ms = [](long long us, char* buf, size_t size) -> const char* {
+        if (us < 0) return "null";
+        snprintf(buf, size, "%.3f", us / 1000.0);
+        return buf;
+    };
+    auto count = [](long n, char* buf, size_t size) -> const char* {
+        if (n < 0) return "null";
+        snprintf(buf, size, "%ld", n);
+        return buf;
+    };
+    char b[9][32];
+    fprintf(stderr,
+            "{\"provider\":\"%s\",\"ok\":%s,\"dns_ms\":%s,\"connect_ms\":%s,\"tls_ms\":%s,"
+            "\"pretransfer_ms\":%s,\"first_byte_ms\":%s,\"total_ms\":%s,\"ttft_ms\":%s,"
+            "\"input_tokens\":%s,\"output_tokens\":%s}\n",
+            t.provider, t.ok ? "true" : "false", ms(t.dns_us, b[0], 32), ms(t.connect_us, b[1], 32),
+            ms(t.tls_us, b[2], 32), ms(t.pretransfer_us, b[3], 32), ms(t.first_byte_us, b[4], 32),
+            ms(t.total_us, b[5], 32), ms(t.first_token_us, b[6], 32), count(t.input_tokens, b[7], 32),
+            count(t.output_tokens, b[8], 32));
+}
+
+// --startup-profile: where a one-shot run spends its time between exec()
+// and the answer, printed to stderr. Each mark() closes a phase that
+// started at the previous one.
+class StartupProfile {
+public:
+    explicit StartupProfile(long long start_ns) : last_ns_(start_ns) {}
+
+    void mark(const char* phase) { mark_at(phase, steady_ns()); }
+
+    void mark_at(const char* phase, long long now_ns) {
+        phases_.push_back(Phase{phase, now_ns - last_ns_});
+        total_ns_ += now_ns - last_ns_;
+        last_ns_ = now_ns;
+    }
+
+    // Breakdown of a finished transfer
+    void transfer(const TransferTiming& t) {
+        char line[160];
+        snprintf(line, sizeof(line), "  %s: dns %.3f connect %.3f tls %.3f first byte %.3f total %.3f ms",
+                 t.provider, t.dns_us / 1000.0, t.connect_us / 1000.0, t.tls_us / 1000.0, t.first_byte_us / 1000.0,
+                 t.total_us / 1000.0);
+        std::lock_guard<std::mutex> lock(mutex_);
+        transfers_.push_back(line);
+    }
+
+    void report() {
+        for (const Phase& phase : phases_) {
+            fprintf(stderr, "%-28s %9.3f ms\n", phase.name, phase.ns / 1e6);
+            if (std::strcmp(phase.name, "request") == 0) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (const std::string& line : transfers_) fprintf(stderr, "%s\n", line.c_str());
+            }
+        }
+        fprintf(stderr, "%-28s %9.3f ms\n", "total", total_ns_ / 1e6);
+    }
+
+private:
+    struct Phase {
+        const char* name;
+        long long ns;
+    };
+
+    std::vector<Phase> phases_;
+    long long last_ns_;
+    long long total_ns_ = 0;
+    std::mutex mutex_;
+    std::vector<std::string> transfers_;
+};
+
+static std::unique_ptr<StartupProfile> startup_profile;
+
+// The exec() and dynamic linking phase can only be seen from before the
+// exec, so the first pass re-executes the binary with the time it did so
+// in the environment. Returns the profile, started at that time.
+std::unique_ptr<StartupProfile> start_startup_profile(char* argv[]) {
+    const char* exec_ns = getenv("SHELL_COMPLETE_PROFILE_EXEC_NS");
+    if (!exec_ns) {
+        setenv("SHELL_COMPLETE_PROFILE_EXEC_NS", std::to_string(steady_ns()).c_str(), 1);
+        execv("/proc/self/exe", argv);
+        // No re-exec: start from static initialization instead
+        std::cerr << "startup-profile: exec failed, loader time not included" << std::endl;
+    }
+    long long main_ns = steady_ns();
+    std::unique_ptr<StartupProfile> profile(new StartupProfile(exec_ns ? std::atoll(exec_ns) : process_init_ns));
+    unsetenv("SHELL_COMPLETE_PROFILE_EXEC_NS");
+    if (exec_ns) profile->mark_at("exec and dynamic linking", process_init_ns);
+    profile->mark_at("static initialization", main_ns);
+    return profile;
+}
+
+// When each provider last answered us (steady_ms), so prewarming can skip
+// a connection that is known to be fresh
+static std::atomic<long long> last_contact_ms[PROVIDER_COUNT];
+
+// The local address each provider's connection was last made from, so a
+// network change can be told apart from one that does not affect it
+static std::mutex local_address_mutex;
+static std::string local_address[PROVIDER_COUNT];
+
+// A transfer on curl reached provider
+static void note_contact(Provider provider, CURL* curl) {
+    last_contact_ms[provider] = steady_ms();
+    char* ip = nullptr;
+    curl_easy_getinfo(curl, CURLINFO_LOCAL_IP, &ip);
+    if (!ip || !*ip) return;
+    std::lock_guard<std::mutex> lock(local_address_mutex);
+    local_address[provider] = ip;
+}
+
+static bool connected_from(const std::string& ip) {
+    std::lock_guard<std::mutex> lock(local_address_mutex);
+    for (const std::string& address : local_address) {
+        if (address == ip) return true;
+    }
+    return false;
+}
+
+// DNS cache, TLS sessions and live connections are shared by every handle
+// in the process, so a request from any terminal can reuse a connection
+// another one opened. libcurl takes these locks from whichever thread is
+// running a transfer. It does not support a shared connection cache in
+// transfers running on several threads at once, though: code that makes
+// requests from more than one thread starts the Transport first, so they
+// all run on its thread (see perform_request()).
+static std::mutex share_locks[CURL_LOCK_DATA_LAST];
+static CURLSH* share_handle = nullptr;
+// Replaced share objects still used by a running transfer
+static std::vector<CURLSH*> retired_shares;
+
+static void share_lock(CURL*, curl_lock_data data, curl_lock_access, void*) {
+    share_locks[data].lock();
+}
+
+static void share_unlock(CURL*, curl_lock_data data, void*) {
+    share_locks[data].unlock();
+}
+
+// Idle easy handles per provider. Handing a handle back here saves setting
+// up a new one; the connections themselves live in the share object. In
+// one-shot mode the pool simply holds the single handle until exit; the
+// daemon reuses them across requests.
+static std::mutex handle_pool_mutex;
+static std::vector<CURL*> handle_pool[PROVIDER_COUNT];
+
+// SHELL_COMPLETE_CA_BUNDLE names a PEM file to verify the providers
+// against instead of the system store. It is mapped once and handed to
+// libcurl in place; a bundle trimmed to the roots the providers chain to
+// saves reading and parsing a few hundred certificates per process.
+#if LIBCURL_VERSION_NUM >= 0x074d00
+static const curl_blob* ca_bundle_blob() {
+    static curl_blob blob;
+    static bool mapped = []() {
+        const char* path = getenv("SHELL_COMPLETE_CA_BUNDLE");
+        if (!path || !*path) return false;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Cannot open CA bundle " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        blob.data = data;
+        blob.len = st.st_size;
+        blob.flags = CURL_BLOB_NOCOPY;
+        return true;
+    }();
+    return mapped ? &blob : nullptr;
+}
+#endif
+
+CURL* acquire_handle(Provider provider) {
+    CURL* curl = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(handle_pool_mutex);
+        if (!share_handle) {
+            share_handle = curl_share_init();
+            curl_share_setopt(share_handle, CURLSHOPT_LOCKFUNC, share_lock);
+            curl_share_setopt(share_handle, CURLSHOPT_UNLOCKFUNC, share_unlock);
+            curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        }
+        std::vector<CURL*>& idle = handle_pool[provider];
+        if (!idle.empty()) {
+            curl = idle.back();
+            idle.pop_back();
+            // Reset options; connections and caches are in the share
+            curl_easy_reset(curl);
+        }
+    }
+    if (!curl) curl = curl_easy_init();
+    if (!curl) return nullptr;
+
+    curl_easy_setopt(curl, CURLOPT_SHARE, share_handle);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+#if LIBCURL_VERSION_NUM >= 0x074d00
+    if (const curl_blob* ca = ca_bundle_blob()) curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, ca);
+#endif
+    return curl;
+}
+
+// Set the endpoint. Over TLS a request waits for a connection that is
+// still being set up rather than open a second one, since ALPN may show
+// it can multiplex. Cleartext HTTP only finds out with the first response,
+// so waiting there would serialize concurrent requests.
+void set_endpoint(CURL* curl, const char* url) {
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, std::strncmp(url, "https:", 6) == 0 ? 1L : 0L);
+}
+
+// Free the retired share objects nothing is attached to any more
+static void sweep_retired_shares_locked() {
+    retired_shares.erase(std::remove_if(retired_shares.begin(), retired_shares.end(),
+                                        [](CURLSH* share) { return curl_share_cleanup(share) == CURLSHE_OK; }),
+                         retired_shares.end());
+}
+
+void release_handle(Provider provider, CURL* curl) {
+    std::lock_guard<std::mutex> lock(handle_pool_mutex);
+    if (!retired_shares.empty()) {
+        // It may still hold on to a retired share; acquire_handle()
+        // attaches the current one
+        curl_easy_setopt(curl, CURLOPT_SHARE, nullptr);
+        sweep_retired_shares_locked();
+    }
+    handle_pool[provider].push_back(curl);
+}
+
+// Start over with a fresh share object, e.g. after the network changed and
+// the cached connections and DNS answers may point nowhere. Transfers that
+// are running keep the old one until they finish; it is freed after that.
+void reset_connections() {
+    std::lock_guard<std::mutex> lock(handle_pool_mutex);
+    if (!share_handle) return;
+    for (int p = 0; p < PROVIDER_COUNT; ++p) {
+        for (CURL* curl : handle_pool[p]) curl_easy_setopt(curl, CURLOPT_SHARE, nullptr);
+    }
+    retired_shares.push_back(share_handle);
+    share_handle = nullptr;
+    sweep_retired_shares_locked();
+    std::fill(std::begin(last_contact_ms), std::end(last_contact_ms), 0LL);
+}
+
+void cleanup_handles() {
+    std::lock_guard<std::mutex> lock(handle_pool_mutex);
+    for (int p = 0; p < PROVIDER_COUNT; ++p) {
+        for (CURL* curl : handle_pool[p]) {
+            curl_easy_cleanup(curl);
+        }
+        handle_pool[p].clear();
+    }
+    // Closes the shared connections; every handle using it is gone by now
+    if (share_handle) {
+        curl_share_cleanup(share_handle);
+        share_handle = nullptr;
+    }
+    sweep_retired_shares_locked();
+}
+
+// Models and system prompts. They are also part of the completion cache
+// key, so changing them invalidates cached answers.
+static const char* const CEREBRAS_MODEL = "gpt-oss-120b";
+static const char* const ANTHROPIC_MODEL = "claude-haiku-4-5-20251001";
+
+static std::string model_from_env(const char* name, const char* fallback) {
+    const char* env = std::getenv(name);
+    return env && *env ? env : fallback;
+}
+
+// SHELL_COMPLETE_CEREBRAS_MODEL and SHELL_COMPLETE_ANTHROPIC_MODEL
+// override the models
+const char* provider_model(Provider provider) {
+    static const std::string models[PROVIDER_COUNT] = {
+        model_from_env("SHELL_COMPLETE_CEREBRAS_MODEL", CEREBRAS_MODEL),
+        model_from_env("SHELL_COMPLETE_ANTHROPIC_MODEL", ANTHROPIC_MODEL),
+    };
+    return models[provider].c_str();
+}
+
+// Generation settings: SHELL_COMPLETE_MAX_TOKENS for either provider and
+// SHELL_COMPLETE_REASONING_EFFORT for Cerebras (empty to leave it out)
+long provider_max_tokens(Provider provider) {
+    const char* env = std::getenv("SHELL_COMPLETE_MAX_TOKENS");
+    if (env && std::atol(env) > 0) return std::atol(env);
+    return provider == PROVIDER_ANTHROPIC ? 150 : 65536;
+}
+
+std::string reasoning_effort() {
+    const char* env = std::getenv("SHELL_COMPLETE_REASONING_EFFORT");
+    return env ? env : "medium";
+}
+
+static const char* const CEREBRAS_SYSTEM_PROMPT =
+    "You complete shell commands. Return ONLY the complete command, no explanations.\n\n"
+    "Current OS: MacOS\nCurrent Shell: Zsh\n"
+    "Examples:\n"
+    "Input: list all files\n"
+    "Output: ls -la\n\n"
+    "Input: find pdf files\n"
+    "Output: find . -name \"*.pdf\"\n\n"
+    "Input: compress logs\n"
+    "Output: tar -czf logs.tar.gz *.log";
+
+static const char* const ANTHROPIC_SYSTEM_PROMPT =
+    "Your task is to complete shell commands or create the command the user describe. Return ONLY the complete command, no additional comments or explanations.\n\n"
+    "Current OS: MacOS\nCurrent Shell: Zsh\n"
+    "Examples:\n"
+    "Input: list all files\n"
+    "Output: ls -la\n\n"
+    "Input: find pdf files\n"
+    "Output: find . -name \"*.pdf\"\n\n"
+    "Input: compress logs\n"
+    "Output: tar -czf logs.tar.gz *.log";
+
+// Request encoding and response decoding specialized to the two provider
+// schemas, so a completion builds no JSON DOM on either side.
+//
+// Within a process the model, prompts and stop sequences never change, so
+// each provider's request body is serialized once with nlohmann::json
+// around a placeholder for the user's input and split there. A request is
+// then the prefix, the escaped input and the suffix. Responses are read
+// with json_find(), one pass over the buffer that follows a fixed path and
+// returns the value in place.
+
+struct RequestTemplate {
+    std::string prefix;
+    std::string suffix;
+};
+
+static const char* const INPUT_PLACEHOLDER = "\x01shell_complete input\x01";
+
+// The body a request would have with the placeholder as command line
+std::string template_body(Provider provider) {
+    std::string content = std::string("Input: ") + INPUT_PLACEHOLDER + "\nOutput:";
+    std::vector<std::string> stops = configured_stop_sequences();
+    json request;
+    if (provider == PROVIDER_CEREBRAS) {
+        request["model"] = provider_model(provider);
+        request["max_tokens"] = provider_max_tokens(provider);
+        request["temperature"] = 0.75;
+        request["stream"] = true;
+        if (!reasoning_effort().empty()) request["reasoning_effort"] = reasoning_effort();
+        request["messages"] = json::array({
+            {{"role", "system"}, {"content", CEREBRAS_SYSTEM_PROMPT}},
+            {{"role", "user"}, {"content", content}}
+        });
+        if (!stops.empty()) request["stop"] = stops;
+    } else {
+        request["model"] = provider_model(provider);
+        request["max_tokens"] = provider_max_tokens(provider);
+        request["stream"] = true;
+        request["system"] = ANTHROPIC_SYSTEM_PROMPT;
+        request["messages"] = json::array({
+            {{"role", "user"}, {"content", content}}
+        });
+        if (!stops.empty()) request["stop_sequences"] = stops;
+    }
+    return request.dump();
+}
+
+const RequestTemplate& request_template(Provider provider) {
+    static RequestTemplate templates[PROVIDER_COUNT];
+    static std::once_flag built[PROVIDER_COUNT];
+    std::call_once(built[provider], [provider]() {
+        std::string body = template_body(provider);
+        // dump() writes the placeholder's control characters as \u0001
+        const std::string marker = "\\u0001shell_complete input\\u0001";
+        size_t at = body.find(marker);
+        templates[provider].prefix = body.substr(0, at);
+        templates[provider].suffix = body.substr(at + marker.size());
+    });
+    return templates[provider];
+}
+
+// Length of the UTF-8 sequence at s[i]. If it is not a well-formed
+// character, invalid is set and the length is that of its longest valid
+// start (at least one byte), which is replaced by a single U+FFFD as the
+// Unicode standard recommends.
+static size_t utf8_sequence(const std::string& s, size_t i, bool& invalid) {
+    unsigned char c = s[i];
+    invalid = false;
+    if (c < 0x80) return 1;
+    size_t need;
+    unsigned char low = 0x80, high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        need = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        need = 2;
+        if (c == 0xE0) low = 0xA0;   // overlong
+        if (c == 0xED) high = 0x9F;  // surrogates
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        need = 3;
+        if (c == 0xF0) low = 0x90;   // overlong
+        if (c == 0xF4) high = 0x8F;  // above U+10FFFF
+    } else {
+        invalid = true;
+        return 1;
+    }
+    for (size_t n = 1; n <= need; ++n) {
+        unsigned char next = i + n < s.size() ? s[i + n] : 0;
+        if (next < low || next > high) {
+            invalid = true;
+            return n;
+        }
+        low = 0x80;
+        high = 0xBF;
+    }
+    return need + 1;
+}
+
+static const char REPLACEMENT_CHARACTER[] = "\xEF\xBF\xBD";
+
+// Length of s once escaped as JSON string contents
+size_t json_escaped_size(const std::string& s) {
+    size_t size = 0;
+    for (size_t i = 0; i < s.size();) {
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+            bool invalid;
+            size_t len = utf8_sequence(s, i, invalid);
+            size += invalid ? sizeof(REPLACEMENT_CHARACTER) - 1 : len;
+            i += len;
+            continue;
+        }
+        if (c == '"' || c == '\\' || c == '\b' || c == '\f' || c == '\n' || c == '\r' || c == '\t') {
+            size += 2;
+        } else if (c < 0x20) {
+            size += 6;
+        } else {
+            size += 1;
+        }
+        ++i;
+    }
+    return size;
+}
+
+// Append s escaped as JSON string contents, byte for byte as dump() does.
+// Malformed UTF-8 (a truncated paste, a Latin-1 file name) would make the
+// body invalid JSON, so it becomes U+FFFD like dump() with
+// error_handler_t::replace.
+void json_escape_append(std::string& out, const std::string& s) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < s.size();) {
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+            bool invalid;
+            size_t len = utf8_sequence(s, i, invalid);
+            if (invalid) {
+                out += REPLACEMENT_CHARACTER;
+            } else {
+                out.append(s, i, len);
+            }
+            i += len;
+            continue;
+        }
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                out += "\\u00";
+                out += digits[c >> 4];
+                out += digits[c & 15];
+            } else {
+                out += (char)c;
+            }
+        }
+        ++i;
+    }
+}
+
+// Request body for command_line, written into out with a single
+// allocation at most (none when out already has the capacity)
+void encode_request(Provider provider, const std::string& command_line, std::string& out) {
+    const RequestTemplate& t = request_template(provider);
+    out.clear();
+    out.reserve(t.prefix.size() + json_escaped_size(command_line) + t.suffix.size());
+    out += t.prefix;
+    json_escape_append(out, command_line);
+    out += t.suffix;
+}
+
+// A JSON value in place: [begin, end) of the buffer it was found in
+struct JsonSpan {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+
+    std::string raw() const { return std::string(begin, end); }
+
+    bool raw_equals(const char* text) const {
+        size_t len = std::strlen(text);
+        return (size_t)(end - begin) == len && std::memcmp(begin, text, len) == 0;
+    }
+
+    // Append the value to out if it is a string, decoding escapes
+    // (\u escapes, surrogate pairs included, become UTF-8; unpaired
+    // surrogates become U+FFFD)
+    bool unescape_into(std::string& out) const;
+};
+
+static const char* json_skip_ws(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+    return p;
+}
+
+// Past the end of the string starting at the opening quote p
+static const char* json_skip_string(const char* p, const char* end) {
+    for (++p; p < end; ++p) {
+        if (*p == '\\') {
+            ++p;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return nullptr;
+}
+
+// Past the end of the value starting at p, or nullptr if it is malformed
+static const char* json_skip_value(const char* p, const char* end) {
+    if (p >= end) return nullptr;
+    if (*p == '"') return json_skip_string(p, end);
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            char c = *p;
+            if (c == '"') {
+                p = json_skip_string(p, end);
+                if (!p) return nullptr;
+                continue;
+            }
+            if (c == '{' || c == '[') ++depth;
+            if (c == '}' || c == ']') {
+                if (--depth == 0) return p + 1;
+            }
+            ++p;
+        }
+        return nullptr;
+    }
+    // Number, true, false or null
+    if (!std::strchr("-0123456789tfn", *p)) return nullptr;
+    const char* start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') ++p;
+    return p > start ? p : nullptr;
+}
+
+// Find the value at path, dot-separated object keys and array indexes
+// ("choices.0.delta.content"), in the JSON text [p, end). Keys are
+// compared as raw bytes, which is enough for the ASCII keys used here.
+bool json_find(const char* p, const char* end, const char* path, JsonSpan& value) {
+    p = json_skip_ws(p, end);
+    while (*path) {
+        const char* dot = std::strchr(path, '.');
+        size_t seg_len = dot ? (size_t)(dot - path) : std::strlen(path);
+        if (p >= end) return false;
+
+        if (*p == '{') {
+            p = json_skip_ws(p + 1, end);
+            bool found = false;
+            while (p < end && *p == '"') {
+                const char* key_end = json_skip_string(p, end);
+                if (!key_end) return false;
+                bool match = (size_t)(key_end - p - 2) == seg_len && std::memcmp(p + 1, path, seg_len) == 0;
+                p = json_skip_ws(key_end, end);
+                if (p >= end || *p != ':') return false;
+                p = json_skip_ws(p + 1, end);
+                if (match) {
+                    found = true;
+                    break;
+                }
+                p = json_skip_value(p, end);
+                if (!p) return false;
+                p = json_skip_ws(p, end);
+                if (p < end && *p == ',') p = json_skip_ws(p + 1, end);
+            }
+            if (!found) return false;
+        } else if (*p == '[') {
+            unsigned long index = std::strtoul(path, nullptr, 10);
+            p = json_skip_ws(p + 1, end);
+            for (unsigned long i = 0; i < index; ++i) {
+                p = json_skip_value(p, end);
+                if (!p) return false;
+                p = json_skip_ws(p, end);
+                if (p >= end || *p != ',') return false;
+                p = json_skip_ws(p + 1, end);
+            }
+            if (p >= end || *p == ']') return false;
+        } else {
+            return false;
+        }
+        path += seg_len;
+        if (*path == '.') ++path;
+    }
+
+    const char* value_end = json_skip_value(p, end);
+    if (!value_end) return false;
+    value.begin = p;
+    value.end = value_end;
+    return true;
+}
+
+bool json_find(const std::string& text, const char* path, JsonSpan& value) {
+    return json_find(text.data(), text.data() + text.size(), path, value);
+}
+
+// Integer at path inside value (an object), or -1 if there is none
+long json_find_count(const JsonSpan& value, const char* path) {
+    JsonSpan number;
+    if (!json_find(value.begin, value.end, path, number)) return -1;
+    char* stop = nullptr;
+    long n = std::strtol(number.begin, &stop, 10);
+    return stop == number.end ? n : -1;
+}
+
+// Whether text is one well-formed value as far as json_skip_value() can
+// tell; only used to tell a malformed response from one we do not expect
+bool json_well_formed(const std::string& text) {
+    const char* end = text.data() + text.size();
+    const char* p = json_skip_value(json_skip_ws(text.data(), end), end);
+    return p && json_skip_ws(p, end) == end;
+}
+
+static void append_utf8(std::string& out, unsigned long cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+static bool read_hex4(const char* p, const char* end, unsigned long& value) {
+    if (end - p < 4) return false;
+    value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JsonSpan::unescape_into(std::string& out) const {
+    if (end - begin < 2 || *begin != '"') return false;
+    const char* p = begin + 1;
+    const char* last = end - 1;
+    while (p < last) {
+        // Copy the run up to the next escape in one go
+        const char* run = p;
+        while (p < last && *p != '\\') ++p;
+        out.append(run, p - run);
+        if (p >= last) break;
+        if (++p >= last) return false;
+        char c = *p++;
+        switch (c) {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            unsigned long cp;
+            if (!read_hex4(p, last, cp)) return false;
+            p += 4;
+            unsigned long low;
+            if (cp >= 0xD800 && cp < 0xDC00 && last - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                read_hex4(p + 2, last, low) && low >= 0xDC00 && low < 0xE000) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            } else if (cp >= 0xD800 && cp < 0xE000) {
+                // An unpaired surrogate has no UTF-8 encoding
+                cp = 0xFFFD;
+            }
+            append_utf8(out, cp);
+            break;
+        }
+        default:
+            // \" \\ \/
+            out += c;
+        }
+    }
+    return true;
+}
+
+// One completion request to one provider: the configured easy handle plus
+// everything its callbacks point at. prepare_request() builds it, then it
+// is driven either by curl_easy_perform() or by a multi handle, and
+// finish_request() turns the outcome into the completion text.
+struct ProviderRequest {
+    ProviderRequest(Provider p, const std::vector<std::string>& stops, const ChunkCallback& on_chunk)
+        : provider(p),
+          builder(stops, on_chunk),
+          stream([this](const std::string& event, const std::string& data) { on_event(event, data); }) {
+        stream.builder = &builder;
+    }
+
+    ~ProviderRequest() {
+        curl_slist_free_all(headers);
+        if (curl) release_handle(provider, curl);
+    }
+
+    void on_event(const std::string& event, const std::string& data);
+    void add_text(const std::string& text);
+    // Token counts from a "usage" object, in either provider's names
+    void read_usage(const JsonSpan& usage);
+
+    Provider provider;
+    CompletionBuilder builder;
+    StreamingResponse stream;
+    CancelToken cancel;
+    std::string payload;
+    // Reused for each decoded piece of text
+    std::string scratch;
+    curl_slist* headers = nullptr;
+    CURL* curl = nullptr;
+    // Outcome once a TransferGroup has reported it finished
+    CURLcode result = CURLE_OK;
+    // steady_ns() when prepared and when the first text arrived
+    long long started_ns = 0;
+    long long first_text_ns = 0;
+    long input_tokens = -1;
+    long output_tokens = -1;
+    // Set when the response came from a fixture instead of the network
+    long long replayed_us = -1;
+    long long replay_first_byte_us = -1;
+
+    ProviderRequest(const ProviderRequest&) = delete;
+    ProviderRequest& operator=(const ProviderRequest&) = delete;
+};
+
+void ProviderRequest::on_event(const std::string& event, const std::string& data) {
+    JsonSpan value;
+    if (provider == PROVIDER_CEREBRAS) {
+        // Each "data:" event carries a chat.completion.chunk whose
+        // choices[0].delta.content is the next piece of text; "[DONE]" ends it
+        if (data == "[DONE]") return;
+        if (json_find(data, "choices.0.delta.content", value)) {
+            scratch.clear();
+            if (value.unescape_into(scratch)) add_text(scratch);
+        } else if (json_find(data, "usage", value)) {
+            // The last chunk, if we read that far
+            read_usage(value);
+        } else if (json_find(data, "error", value)) {
+            std::cerr << "API error: " << value.raw() << std::endl;
+        } else if (!json_well_formed(data)) {
+            std::cerr << "JSON parse error: " << data << std::endl;
+        }
+        return;
+    }
+
+    // Anthropic: text arrives in content_block_delta events as text_delta
+    if (event == "error") {
+        if (json_find(data, "error", value)) std::cerr << "API error: " << value.raw() << std::endl;
+        return;
+    }
+    // Usage comes at the start (input) and in message_delta (output so far)
+    if (event == "message_start") {
+        if (json_find(data, "message.usage", value)) read_usage(value);
+        return;
+    }
+    if (event == "message_delta") {
+        if (json_find(data, "usage", value)) read_usage(value);
+        return;
+    }
+    if (event != "content_block_delta") return;
+    JsonSpan type;
+    if (json_find(data, "delta.type", type) && type.raw_equals("\"text_delta\"") &&
+        json_find(data, "delta.text", value)) {
+        scratch.clear();
+        if (value.unescape_into(scratch)) add_text(scratch);
+    } else if (!json_well_formed(data)) {
+        std::cerr << "JSON parse error: " << data << std::endl;
+    }
+}
+
+void ProviderRequest::add_text(const std::string& text) {
+    if (!first_text_ns && !text.empty()) first_text_ns = steady_ns();
+    builder.add(text);
+}
+
+void ProviderRequest::read_usage(const JsonSpan& usage) {
+    long n = json_find_count(usage, provider == PROVIDER_CEREBRAS ? "prompt_tokens" : "input_tokens");
+    if (n >= 0) input_tokens = n;
+    n = json_find_count(usage, provider == PROVIDER_CEREBRAS ? "completion_tokens" : "output_tokens");
+    if (n >= 0) output_tokens = n;
+}
+
+std::unique_ptr<ProviderRequest> prepare_cerebras(const std::string& command_line, const ChunkCallback& on_chunk) {
+    const char* api_key = std::getenv("CEREBRAS_API_KEY");
+    if (!api_key) {
+        std::cerr << "Error: CEREBRAS_API_KEY not set" << std::endl;
+        return nullptr;
+    }
+
+    std::unique_ptr<ProviderRequest> req(new ProviderRequest(PROVIDER_CEREBRAS, configured_stop_sequences(), on_chunk));
+    encode_request(PROVIDER_CEREBRAS, command_line, req->payload);
+
+    // Take a warm handle from the pool (or create one)
+    req->curl = acquire_handle(PROVIDER_CEREBRAS);
+    if (!req->curl) {
+        std::cerr << "Failed to initialize curl" << std::endl;
+        return nullptr;
+    }
+
+    // Set curl options
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
+    req->headers = curl_slist_append(req->headers, ("Authorization: Bearer " + std::string(api_key)).c_str());
+
+    set_endpoint(req->curl, (std::string(provider_origin(PROVIDER_CEREBRAS)) + "v1/chat/completions").c_str());
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->payload.c_str());
+    curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, stream_write_callback);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, &req->stream);
+    return req;
+}
+
+std::unique_ptr<ProviderRequest> prepare_anthropic(const std::string& command_line, const ChunkCallback& on_chunk) {
+    const char* api_key = std::getenv("ANTHROPIC_API_KEY");
+    if (!api_key) {
+        std::cerr << "Error: ANTHROPIC_API_KEY not set" << std::endl;
+        return nullptr;
+    }
+
+    std::unique_ptr<ProviderRequest> req(new ProviderRequest(PROVIDER_ANTHROPIC, configured_stop_sequences(), on_chunk));
+    encode_request(PROVIDER_ANTHROPIC, command_line, req->payload);
+
+    // Take a warm handle from the pool (or create one)
+    req->curl = acquire_handle(PROVIDER_ANTHROPIC);
+    if (!req->curl) {
+        std::cerr << "Failed to initialize curl" << std::endl;
+        return nullptr;
+    }
+
+    // Set curl options
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
+    req->headers = curl_slist_append(req->headers, ("x-api-key: " + std::string(api_key)).c_str());
+    req->headers = curl_slist_append(req->headers, "anthropic-version: 2023-06-01");
+
+    set_endpoint(req->curl, (std::string(provider_origin(PROVIDER_ANTHROPIC)) + "v1/messages").c_str());
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, req->payload.c_str());
+    curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, stream_write_callback);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, &req->stream);
+    return req;
+}
+
+// Record/replay of provider HTTP exchanges, so tests and benchmarks can
+// run offline with the timing of a real session. Set SHELL_COMPLETE_FIXTURES
+// to a file and SHELL_COMPLETE_FIXTURE_MODE to:
+//   record   send requests as usual and append each exchange to the file
+//   replay   answer requests found in the file from memory, others live
+//   strict   like replay, but fail any request that is not in the file
+// A request matches a fixture when provider and body are identical; the
+// same request recorded several times is replayed in order. Replayed
+// responses are fed to the stream callback with their recorded timing,
+// scaled by SHELL_COMPLETE_FIXTURE_SPEED (1 = as recorded, 0.1 = ten
+// times faster, 0 = all at once).
+//
+// File format, one exchange after another:
+//   FIXTURE <provider> <status> <chunks> <body length>\n<request body>\n
+// then per chunk of the response, in order of arrival:
+//   <microseconds after the request started> <length>\n<bytes>\n
+class HttpFixtures {
+public:
+    bool recording() {
+        configure();
+        return mode_ == RECORD;
+    }
+
+    bool replaying() {
+        configure();
+        return mode_ == REPLAY || mode_ == STRICT;
+    }
+
+    // Append a finished exchange to the file
+    void record(ProviderRequest& req) {
+        long status = 0;
+        curl_easy_getinfo(req.curl, CURLINFO_RESPONSE_CODE, &status);
+        std::string entry = "FIXTURE " + std::string(provider_name(req.provider)) + " " + std::to_string(status) +
+                            " " + std::to_string(req.stream.recorded.size()) + " " +
+                            std::to_string(req.payload.size()) + "\n" + req.payload + "\n";
+        for (const RecordedChunk& chunk : req.stream.recorded) {
+            entry += std::to_string(std::max(0LL, (chunk.at_ns - req.started_ns) / 1000)) + " " +
+                     std::to_string(chunk.data.size()) + "\n" + chunk.data + "\n";
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        // One write with O_APPEND: concurrent recorders do not interleave
+        int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0 || write(fd, entry.data(), entry.size()) != (ssize_t)entry.size()) {
+            std::cerr << "Cannot record fixture to " << path_ << ": " << strerror(errno) << std::endl;
+        }
+        if (fd >= 0) close(fd);
+    }
+
+    // Serve req from the fixtures. Returns false if there is none and the
+    // request should go out live; otherwise res is the transfer result.
+    bool replay(ProviderRequest& req, CURLcode& res) {
+        const Fixture* fixture = next_fixture(req);
+        if (!fixture) {
+            if (mode_ != STRICT) return false;
+            std::cerr << provider_name(req.provider) << ": no fixture for this request in " << path_ << std::endl;
+            res = CURLE_COULDNT_CONNECT;
+            return true;
+        }
+
+        long long start_ns = steady_ns();
+        res = CURLE_OK;
+        for (size_t i = 0; i < fixture->chunks.size(); ++i) {
+            const Fixture::Chunk& chunk = fixture->chunks[i];
+            long long due_ns = start_ns + (long long)(chunk.offset_us * 1000 * speed_);
+            long long wait_ns = due_ns - steady_ns();
+            if (wait_ns > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(wait_ns));
+            if (req.cancel.cancelled()) {
+                res = CURLE_ABORTED_BY_CALLBACK;
+                break;
+            }
+            if (i == 0) req.replay_first_byte_us = (steady_ns() - start_ns) / 1000;
+            std::string data = chunk.data;
+            if (stream_write_callback(&data[0], 1, data.size(), &req.stream) != data.size()) {
+                res = CURLE_WRITE_ERROR;
+                break;
+            }
+        }
+        req.replayed_us = (steady_ns() - start_ns) / 1000;
+        return true;
+    }
+
+private:
+    enum Mode { OFF, RECORD, REPLAY, STRICT };
+
+    struct Fixture {
+        struct Chunk {
+            long long offset_us;
+            std::string data;
+        };
+        std::vector<Chunk> chunks;
+    };
+
+    void configure() {
+        std::call_once(configured_, [this]() {
+            const char* path = std::getenv("SHELL_COMPLETE_FIXTURES");
+            if (!path || !*path) return;
+            path_ = path;
+            const char* mode = std::getenv("SHELL_COMPLETE_FIXTURE_MODE");
+            std::string name = mode ? mode : "replay";
+            if (name == "record") {
+                mode_ = RECORD;
+                return;
+            }
+            if (name != "replay" && name != "strict") {
+                std::cerr << "Unknown SHELL_COMPLETE_FIXTURE_MODE: " << name << std::endl;
+                return;
+            }
+            mode_ = name == "strict" ? STRICT : REPLAY;
+            const char* speed = std::getenv("SHELL_COMPLETE_FIXTURE_SPEED");
+            speed_ = speed && *speed ? std::max(0.0, std::atof(speed)) : 1.0;
+            load();
+        });
+    }
+
+    void load() {
+        std::ifstream in(path_, std::ios::binary);
+        if (!in) {
+            std::cerr << "Cannot read fixtures from " << path_ << std::endl;
+            return;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream header(line);
+            std::string tag, provider;
+            long status;
+            size_t chunks, length;
+            if (!(header >> tag >> provider >> status >> chunks >> length) || tag != "FIXTURE") break;
+            std::string payload(length, '\0');
+            if (!in.read(&payload[0], length) || in.get() != '\n') break;
+            Fixture fixture;
+            for (size_t i = 0; i < chunks; ++i) {
+                Fixture::Chunk chunk;
+                size_t size;
+                if (!std::getline(in, line) || !(std::istringstream(line) >> chunk.offset_us >> size)) break;
+                chunk.data.resize(size);
+                if (!in.read(&chunk.data[0], size) || in.get() != '\n') break;
+                fixture.chunks.push_back(chunk);
+            }
+            if (fixture.chunks.size() != chunks) break;
+            fixtures_[provider + '\0' + payload].push_back(fixture);
+        }
+        if (!in.eof()) std::cerr << "Fixture file " << path_ << " is damaged; using what was read" << std::endl;
+    }
+
+    // The fixture for req's next occurrence; the last one repeats
+    const Fixture* next_fixture(const ProviderRequest& req) {
+        std::string key = std::string(provider_name(req.provider)) + '\0' + req.payload;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = fixtures_.find(key);
+        if (it == fixtures_.end()) return nullptr;
+        size_t& next = cursors_[key];
+        const Fixture* fixture = &it->second[std::min(next, it->second.size() - 1)];
+        ++next;
+        return fixture;
+    }
+
+    std::once_flag configured_;
+    Mode mode_ = OFF;
+    std::string path_;
+    double speed_ = 1.0;
+    std::mutex mutex_;
+    std::map<std::string, std::vector<Fixture>> fixtures_;
+    std::map<std::string, size_t> cursors_;
+};
+
+static HttpFixtures http_fixtures;
+
+// Progress callback: a non-zero return aborts the transfer with
+// CURLE_ABORTED_BY_CALLBACK once a newer request has superseded it
+int cancel_xferinfo_callback(void* clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    const CancelToken* cancel = (const CancelToken*)clientp;
+    return cancel->cancelled() ? 1 : 0;
+}
+
+std::unique_ptr<ProviderRequest> prepare_request(Provider provider, const std::string& command_line,
+                                                 const ChunkCallback& on_chunk,
+                                                 const CancelToken& cancel = CancelToken()) {
+    std::unique_ptr<ProviderRequest> req = provider == PROVIDER_ANTHROPIC ? prepare_anthropic(command_line, on_chunk)
+                                                                          : prepare_cerebras(command_line, on_chunk);
+    if (req && cancel) {
+        req->cancel = cancel;
+        curl_easy_setopt(req->curl, CURLOPT_XFERINFOFUNCTION, cancel_xferinfo_callback);
+        curl_easy_setopt(req->curl, CURLOPT_XFERINFODATA, &req->cancel);
+        curl_easy_setopt(req->curl, CURLOPT_NOPROGRESS, 0L);
+    }
+    if (req) {
+        req->stream.record = http_fixtures.recording();
+        req->started_ns = steady_ns();
+    }
+    return req;
+}
+
+// mkdir -p, one component at a time
+bool make_directories(const std::string& dir) {
+    for (size_t pos = 1; pos != std::string::npos; ) {
+        pos = dir.find('/', pos + 1);
+        std::string prefix = dir.substr(0, pos);
+        if (mkdir(prefix.c_str(), 0700) < 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+// Directory for small persistent state files: $XDG_STATE_HOME/shell_complete
+// or ~/.local/state/shell_complete. Created on first use; "" if impossible.
+std::string state_directory() {
+    std::string base;
+    const char* xdg = std::getenv("XDG_STATE_HOME");
+    const char* home = std::getenv("HOME");
+    if (xdg && *xdg) {
+        base = xdg;
+    } else if (home && *home) {
+        base = std::string(home) + "/.local/state";
+    } else {
+        return "";
+    }
+    std::string dir = base + "/shell_complete";
+    return make_directories(dir) ? dir : "";
+}
+
+// Observed latency of one provider. Connect time, time to first byte and
+// total time are smoothed with an EWMA; the most recent totals are kept to
+// estimate the tail.
+struct ProviderLatency {
+    static const size_t RECENT = 32;
+
+    unsigned long samples = 0;
+    unsigned long failures = 0;
+    double connect_ms = 0;
+    double ttfb_ms = 0;
+    double total_ms = 0;
+    std::vector<double> recent;  // oldest first
+
+    void add(double connect, double ttfb, double total) {
+        const double alpha = 0.2;
+        if (samples == 0) {
+            connect_ms = connect;
+            ttfb_ms = ttfb;
+            total_ms = total;
+        } else {
+            connect_ms += alpha * (connect - connect_ms);
+            ttfb_ms += alpha * (ttfb - ttfb_ms);
+            total_ms += alpha * (total - total_ms);
+        }
+        ++samples;
+        recent.push_back(total);
+        if (recent.size() > RECENT) recent.erase(recent.begin());
+    }
+
+    double p95() const {
+        if (recent.empty()) return 0;
+        std::vector<double> sorted(recent);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[(sorted.size() * 95 - 1) / 100];
+    }
+
+    // Lower is better: halfway between the typical and the tail latency
+    double score() const {
+        return (total_ms + p95()) / 2;
+    }
+};
+
+// Per-provider latency history used to route requests to whichever
+// provider has been fastest recently. Kept in memory (the daemon) and
+// mirrored to $XDG_STATE_HOME/shell_complete/latency so one-shot runs
+// and the daemon learn from each other. Every process adds its samples
+// to what is on disk under a lock, and rereads the file when another
+// process has replaced it.
+class LatencyTracker {
+public:
+    // Recorded for failed requests so a broken provider stops being chosen
+    static constexpr double FAILURE_PENALTY_MS = 5000;
+
+    void record(Provider provider, CURL* curl, bool ok) {
+        curl_off_t connect = 0, ttfb = 0, total = 0;
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        load_locked();
+        // Start from the file as it is now, so samples other processes
+        // saved since we last read it are kept
+        int lock_fd = path_.empty() ? -1 : open((path_ + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (lock_fd >= 0) flock(lock_fd, LOCK_EX);
+        refresh_locked(true);
+        ProviderLatency& p = providers_[provider];
+        if (ok) {
+            p.add(connect / 1000.0, ttfb / 1000.0, total / 1000.0);
+        } else {
+            ++p.failures;
+            p.add(connect / 1000.0, FAILURE_PENALTY_MS, FAILURE_PENALTY_MS);
+        }
+        save_locked();
+        if (lock_fd >= 0) close(lock_fd);
+    }
+
+    // Provider with the best score among those allowed. Providers with too
+    // few samples, and a random share of requests (SHELL_COMPLETE_EXPLORE,
+    // default 0.05), go to the other provider so its numbers stay fresh.
+    Provider choose(const bool allowed[PROVIDER_COUNT]) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        load_locked();
+        refresh_locked();
+
+        std::vector<Provider> candidates;
+        for (int p = 0; p < PROVIDER_COUNT; ++p) {
+            if (allowed[p]) candidates.push_back((Provider)p);
+        }
+        if (candidates.empty()) return PROVIDER_CEREBRAS;
+
+        for (Provider p : candidates) {
+            if (providers_[p].samples < MIN_SAMPLES) return p;
+        }
+
+        Provider best = candidates[0];
+        for (Provider p : candidates) {
+            if (providers_[p].score() < providers_[best].score()) best = p;
+        }
+
+        const char* explore_env = std::getenv("SHELL_COMPLETE_EXPLORE");
+        double explore = explore_env ? std::atof(explore_env) : 0.05;
+        if (!seeded_) {
+            rng_.seed(std::random_device()());
+            seeded_ = true;
+        }
+        if (candidates.size() > 1 && std::uniform_real_distribution<double>(0, 1)(rng_) < explore) {
+            std::vector<Provider> others;
+            for (Provider p : candidates) {
+                if (p != best) others.push_back(p);
+            }
+            return others[std::uniform_int_distribution<size_t>(0, others.size() - 1)(rng_)];
+        }
+        return best;
+    }
+
+private:
+    static const unsigned long MIN_SAMPLES = 3;
+
+    // File format, one line per provider:
+    //   <name> <samples> <failures> <connect> <ttfb> <total> <recent totals...>
+    void load_locked() {
+        if (loaded_) return;
+        loaded_ = true;
+        std::string dir = state_directory();
+        if (dir.empty()) return;
+        path_ = dir + "/latency";
+        refresh_locked();
+    }
+
+    // Read the file again if it was replaced since we last read or wrote
+    // it (or always, with force). Every save is a rename, so the inode
+    // changes, though a freed inode number can come back.
+    void refresh_locked(bool force = false) {
+        struct stat st;
+        if (path_.empty() || stat(path_.c_str(), &st) < 0) return;
+        if (!force && st.st_ino == file_.st_ino && st.st_mtime == file_.st_mtime && st.st_size == file_.st_size) {
+            return;
+        }
+        file_ = st;
+        std::ifstream in(path_);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string name;
+            ProviderLatency p;
+            if (!(fields >> name >> p.samples >> p.failures >> p.connect_ms >> p.ttfb_ms >> p.total_ms)) continue;
+            double v;
+            while (fields >> v && p.recent.size() < ProviderLatency::RECENT) p.recent.push_back(v);
+            for (int i = 0; i < PROVIDER_COUNT; ++i) {
+                if (name == provider_name((Provider)i)) providers_[i] = p;
+            }
+        }
+    }
+
+    void save_locked() {
+        if (path_.empty()) return;
+        std::string tmp = path_ + "." + std::to_string(getpid());
+        {
+            std::ofstream out(tmp);
+            for (int i = 0; i < PROVIDER_COUNT; ++i) {
+                const ProviderLatency& p = providers_[i];
+                out << provider_name((Provider)i) << " " << p.samples << " " << p.failures << " "
+                    << p.connect_ms << " " << p.ttfb_ms << " " << p.total_ms;
+                for (double v : p.recent) out << " " << v;
+                out << "\n";
+            }
+            if (!out) {
+                unlink(tmp.c_str());
+                return;
+            }
+        }
+        // Atomic replace: concurrent shells never see a torn file
+        if (rename(tmp.c_str(), path_.c_str()) < 0) {
+            unlink(tmp.c_str());
+            return;
+        }
+        stat(path_.c_str(), &file_);
+    }
+
+    std::mutex mutex_;
+    bool loaded_ = false;
+    std::string path_;
+    // The file as last read or written
+    struct stat file_ = {};
+    ProviderLatency providers_[PROVIDER_COUNT];
+    // Seeded on first use so runs that never route stay cheap to start
+    std::mt19937 rng_;
+    bool seeded_ = false;
+};
+
+static LatencyTracker latency_tracker;
+
+// Directory for disposable data: $XDG_CACHE_HOME/shell_complete or
+// ~/.cache/shell_complete. Created on first use; "" if impossible.
+std::string cache_directory() {
+    std::string base;
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    const char* home = std::getenv("HOME");
+    if (xdg && *xdg) {
+        base = xdg;
+    } else if (home && *home) {
+        base = std::string(home) + "/.cache";
+    } else {
+        return "";
+    }
+    std::string dir = base + "/shell_complete";
+    return make_directories(dir) ? dir : "";
+}
+
+// 64-bit FNV-1a
+uint64_t fnv1a(const std::string& data, uint64_t hash = 14695981039346656037ULL) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Input as it is looked up in caches: surrounding whitespace dropped and
+// inner runs of whitespace collapsed to one space
+std::string normalize_input(const std::string& input) {
+    std::string out;
+    out.reserve(input.size());
+    bool pending_space = false;
+    for (char c : input) {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            pending_space = !out.empty();
+            continue;
+        }
+        if (pending_space) out += ' ';
+        pending_space = false;
+        out += c;
+    }
+    return out;
+}
+
+// Everything besides the input that decides what the model answers: the
+// provider selection, both models and prompts, the stop sequences and the
+// generation settings
+std::string context_fingerprint() {
+    const char* provider = std::getenv("SHELL_COMPLETE_PROVIDER");
+    const char* stop = std::getenv("SHELL_COMPLETE_STOP");
+    std::string context = provider ? provider : "cerebras";
+    context += '\0';
+    context += provider_model(PROVIDER_CEREBRAS);
+    context += '\0';
+    context += provider_model(PROVIDER_ANTHROPIC);
+    context += '\0';
+    context += stop ? stop : "";
+    // Only when set, so the default settings keep their cache keys
+    const char* max_tokens = std::getenv("SHELL_COMPLETE_MAX_TOKENS");
+    const char* effort = std::getenv("SHELL_COMPLETE_REASONING_EFFORT");
+    if (max_tokens || effort) {
+        context += '\0';
+        context += max_tokens ? max_tokens : "";
+        context += '\0';
+        context += effort ? effort : "medium";
+    }
+    uint64_t prompts = fnv1a(ANTHROPIC_SYSTEM_PROMPT, fnv1a(CEREBRAS_SYSTEM_PROMPT));
+    return context + '\0' + std::to_string(prompts);
+}
+
+// Persistent completion cache shared by every shell_complete process of
+// the user: an open-addressing hash table in a memory-mapped file.
+//
+//   header | slots[SLOT_COUNT] | data area (append-only records)
+//
+// A slot holds the 64-bit key hash and a packed (offset, length) reference
+// to a record in the data area; a record is the full key followed by the
+// completion, so hash collisions are detected. Writers reserve record space
+// with an atomic fetch-add, write the record, claim a slot by CAS on its
+// hash and only then publish the reference with a release store. Readers
+// never lock: they see either no reference yet (a miss) or a complete
+// record. When the data area fills up, one process rebuilds the live
+// entries into a fresh file and renames it over the old one; processes
+// still mapping the old file keep working on it until they reopen.
+class CompletionCache {
+public:
+    ~CompletionCache() { unmap(); }
+
+    bool lookup(const std::string& key, std::string& completion) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_if_needed()) return false;
+        uint64_t hash = key_hash(key);
+        uint64_t now = (uint64_t)time(nullptr);
+        for (uint32_t probe = 0; probe < MAX_PROBES; ++probe) {
+            Slot& slot = slots_[(hash + probe) % SLOT_COUNT];
+            uint64_t slot_hash = __atomic_load_n(&slot.hash, __ATOMIC_ACQUIRE);
+            if (slot_hash == 0) return false;
+            if (slot_hash != hash) continue;
+            uint64_t ref = __atomic_load_n(&slot.ref, __ATOMIC_ACQUIRE);
+            return ref != 0 && read_record(ref, key, now, completion);
+        }
+        return false;
+    }
+
+    void insert(const std::string& key, const std::string& completion) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_if_needed()) return;
+        if (!append(key, completion)) needs_compaction_ = true;
+    }
+
+    // Set once the table is full. Callers run compact_now() off the
+    // latency path: the daemon in a thread, one-shot runs in a child
+    // process after the answer has been printed.
+    bool needs_compaction() const { return needs_compaction_; }
+
+    // Rebuild the live entries into a fresh file and switch to it
+    void compact_now() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!map_ || !needs_compaction_) return;
+        needs_compaction_ = false;
+        if (compact()) reopen();
+    }
+
+    // The daemon keeps its mapping for a long time; pick up a file that
+    // was replaced by another process's compaction
+    void reopen_if_replaced() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        struct stat st;
+        if (!map_ || (stat(path_.c_str(), &st) == 0 && st.st_ino == inode_)) return;
+        reopen();
+    }
+
+private:
+    static const uint32_t SLOT_COUNT = 16384;
+    static const uint32_t MAX_PROBES = 64;
+    static const uint64_t DATA_SIZE = 4 * 1024 * 1024;
+    static const uint32_t VERSION = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t slot_count;
+        uint64_t data_size;
+        uint64_t data_used;  // atomic
+    };
+
+    struct Slot {
+        uint64_t hash;  // atomic; 0 = empty
+        uint64_t ref;   // atomic; offset << 32 | length, 0 = not yet published
+    };
+
+    // Record layout in the data area
+    struct RecordHeader {
+        uint64_t created;
+        uint32_t key_length;
+        uint32_t value_length;
+    };
+
+    static uint64_t key_hash(const std::string& key) {
+        uint64_t hash = fnv1a(key);
+        return hash ? hash : 1;
+    }
+
+    static size_t file_size() {
+        return sizeof(Header) + SLOT_COUNT * sizeof(Slot) + DATA_SIZE;
+    }
+
+    static uint64_t ttl_seconds() {
+        const char* env = std::getenv("SHELL_COMPLETE_CACHE_TTL");
+        return env ? std::strtoull(env, nullptr, 10) : 7 * 24 * 3600;
+    }
+
+    bool read_record(uint64_t ref, const std::string& key, uint64_t now, std::string& completion) const {
+        uint64_t offset = ref >> 32, length = ref & 0xffffffffu;
+        if (offset + length > DATA_SIZE || length < sizeof(RecordHeader)) return false;
+        const char* record = data_ + offset;
+        RecordHeader rh;
+        std::memcpy(&rh, record, sizeof(rh));
+        if (sizeof(rh) + (uint64_t)rh.key_length + rh.value_length != length) return false;
+        if (rh.key_length != key.size() || std::memcmp(record + sizeof(rh), key.data(), key.size()) != 0) return false;
+        if (now > rh.created + ttl_seconds()) return false;
+        completion.assign(record + sizeof(rh) + rh.key_length, rh.value_length);
+        return true;
+    }
+
+    bool append(const std::string& key, const std::string& completion) {
+        uint64_t length = sizeof(RecordHeader) + key.size() + completion.size();
+        uint64_t offset = __atomic_fetch_add(&header_->data_used, length, __ATOMIC_RELAXED);
+        if (offset + length > DATA_SIZE) return false;
+
+        RecordHeader rh;
+        rh.created = (uint64_t)time(nullptr);
+        rh.key_length = (uint32_t)key.size();
+        rh.value_length = (uint32_t)completion.size();
+        char* record = data_ + offset;
+        std::memcpy(record, &rh, sizeof(rh));
+        std::memcpy(record + sizeof(rh), key.data(), key.size());
+        std::memcpy(record + sizeof(rh) + key.size(), completion.data(), completion.size());
+        uint64_t ref = offset << 32 | length;
+
+        uint64_t hash = key_hash(key);
+        for (uint32_t probe = 0; probe < MAX_PROBES; ++probe) {
+            Slot& slot = slots_[(hash + probe) % SLOT_COUNT];
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&slot.hash, &expected, hash, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+                expected == hash) {
+                __atomic_store_n(&slot.ref, ref, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool open_if_needed() {
+        if (map_) return true;
+        if (tried_) return false;
+        tried_ = true;
+        const char* env = std::getenv("SHELL_COMPLETE_CACHE");
+        if (env && std::string(env) == "0") return false;
+        std::string dir = cache_directory();
+        if (dir.empty()) return false;
+        path_ = dir + "/completions";
+        return reopen();
+    }
+
+    bool reopen() {
+        unmap();
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            int fd = open(path_.c_str(), O_RDWR);
+            if (fd < 0 && errno == ENOENT) {
+                create_file(path_, false);
+                continue;
+            }
+            if (fd < 0) return false;
+            struct stat st;
+            void* map = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size == file_size()) {
+                map = mmap(nullptr, file_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (map != MAP_FAILED) {
+                const Header* h = (const Header*)map;
+                if (std::memcmp(h->magic, "SHCOMPL", 8) == 0 && h->version == VERSION &&
+                    h->slot_count == SLOT_COUNT && h->data_size == DATA_SIZE) {
+                    map_ = (char*)map;
+                    header_ = (Header*)map_;
+                    slots_ = (Slot*)(map_ + sizeof(Header));
+                    data_ = map_ + sizeof(Header) + SLOT_COUNT * sizeof(Slot);
+                    inode_ = st.st_ino;
+                    return true;
+                }
+                munmap(map, file_size());
+            }
+            // Different layout or damaged: start over
+            create_file(path_, true);
+        }
+        return false;
+    }
+
+    void unmap() {
+        if (map_) munmap(map_, file_size());
+        map_ = data_ = nullptr;
+        header_ = nullptr;
+        slots_ = nullptr;
+    }
+
+    // Initialize a new file next to path and move it into place. Without
+    // replace, link() makes creation atomic: if another process got there
+    // first, its file is kept.
+    static bool create_file(const std::string& path, bool replace, const CompletionCache* source = nullptr) {
+        std::string tmp = path + ".tmp." + std::to_string(getpid());
+        int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) return false;
+        bool ok = ftruncate(fd, (off_t)file_size()) == 0;
+        void* map = ok ? mmap(nullptr, file_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (map == MAP_FAILED) {
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        CompletionCache fresh;
+        fresh.map_ = (char*)map;
+        fresh.header_ = (Header*)map;
+        fresh.slots_ = (Slot*)(fresh.map_ + sizeof(Header));
+        fresh.data_ = fresh.map_ + sizeof(Header) + SLOT_COUNT * sizeof(Slot);
+        std::memcpy(fresh.header_->magic, "SHCOMPL", 8);
+        fresh.header_->version = VERSION;
+        fresh.header_->slot_count = SLOT_COUNT;
+        fresh.header_->data_size = DATA_SIZE;
+        if (source) source->copy_live_entries(fresh);
+        fresh.unmap();
+
+        if (replace) {
+            ok = rename(tmp.c_str(), path.c_str()) == 0;
+        } else {
+            ok = link(tmp.c_str(), path.c_str()) == 0 || errno == EEXIST;
+        }
+        unlink(tmp.c_str());
+        return ok;
+    }
+
+    // Copy unexpired entries, newest first, until the new file is half
+    // full so that it does not need compacting again right away
+    void copy_live_entries(CompletionCache& target) const {
+        struct Live {
+            uint64_t created;
+            uint64_t offset;
+            uint64_t length;
+        };
+        std::vector<Live> live;
+        uint64_t now = (uint64_t)time(nullptr);
+        for (uint32_t i = 0; i < SLOT_COUNT; ++i) {
+            uint64_t ref = __atomic_load_n(&slots_[i].ref, __ATOMIC_ACQUIRE);
+            uint64_t offset = ref >> 32, length = ref & 0xffffffffu;
+            if (ref == 0 || offset + length > DATA_SIZE || length < sizeof(RecordHeader)) continue;
+            RecordHeader rh;
+            std::memcpy(&rh, data_ + offset, sizeof(rh));
+            if (sizeof(rh) + (uint64_t)rh.key_length + rh.value_length != length) continue;
+            if (now > rh.created + ttl_seconds()) continue;
+            live.push_back(Live{rh.created, offset, length});
+        }
+        std::sort(live.begin(), live.end(), [](const Live& a, const Live& b) { return a.created > b.created; });
+
+        uint64_t bytes = 0;
+        size_t count = 0;
+        for (const Live& entry : live) {
+            if (count >= SLOT_COUNT / 2 || bytes + entry.length > DATA_SIZE / 2) break;
+            RecordHeader rh;
+            std::memcpy(&rh, data_ + entry.offset, sizeof(rh));
+            std::string key(data_ + entry.offset + sizeof(rh), rh.key_length);
+            std::string value(data_ + entry.offset + sizeof(rh) + rh.key_length, rh.value_length);
+            if (!target.append(key, value)) break;
+            bytes += entry.length;
+            ++count;
+        }
+    }
+
+    // Only one process compacts at a time; the others just skip caching
+    // this answer while it runs
+    bool compact() {
+        std::string lock_path = path_ + ".lock";
+        int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (lock_fd < 0) return false;
+        bool ok = false;
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) == 0) {
+            struct stat st;
+            // Someone else may have compacted already
+            if (stat(path_.c_str(), &st) == 0 && st.st_ino == inode_) {
+                ok = create_file(path_, true, this);
+            } else {
+                ok = true;
+            }
+            flock(lock_fd, LOCK_UN);
+        }
+        close(lock_fd);
+        return ok;
+    }
+
+    // Guards the mapping within this process (the daemon's threads); other
+    // processes are only coordinated through the atomics in the file
+    std::mutex mutex_;
+    std::string path_;
+    bool tried_ = false;
+    bool needs_compaction_ = false;
+    char* map_ = nullptr;
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+    char* data_ = nullptr;
+    ino_t inode_ = 0;
+};
+
+static CompletionCache completion_cache;
+
+// Cache key: normalized input plus the context that shaped the answer
+std::string completion_cache_key(const std::string& command_line) {
+    return normalize_input(command_line) + '\0' + context_fingerprint();
+}
+
+// Rolling latency histograms per result source (cache, local, remote),
+// provider and model, kept in $XDG_STATE_HOME/shell_complete/stats and
+// printed by --stats. The file has a fixed size and is mapped shared by
+// every process; all updates are relaxed atomic adds, so recording never
+// takes a lock and concurrent shells and the daemon add up correctly.
+//
+// Latencies are in microseconds in log-linear buckets as in HDR
+// histograms: values below SUB_BUCKETS get a bucket each, above that every
+// power of two is split into SUB_BUCKETS linear buckets, which keeps any
+// reported percentile within about 3% of the true value.
+class LatencyStats {
+public:
+    ~LatencyStats() {
+        if (header_) munmap(header_, file_size());
+    }
+
+    // One completion (or provider transfer) answered from source
+    void record(const char* source, const char* provider, const char* model, long long latency_us, bool ok,
+                bool timed_out = false, uint64_t bytes = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_if_needed()) return;
+        Series* series = find_series(source, provider, model);
+        if (!series) return;
+        uint64_t value = latency_us < 0 ? 0 : (uint64_t)latency_us;
+        __atomic_fetch_add(&series->count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&series->sum_us, value, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&series->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+        if (!ok) __atomic_fetch_add(&series->failures, 1, __ATOMIC_RELAXED);
+        if (timed_out) __atomic_fetch_add(&series->timeouts, 1, __ATOMIC_RELAXED);
+        if (bytes) __atomic_fetch_add(&series->bytes, bytes, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&series->max_us, __ATOMIC_RELAXED);
+        while (value > max && !__atomic_compare_exchange_n(&series->max_us, &max, value, true, __ATOMIC_RELAXED,
+                                                           __ATOMIC_RELAXED)) {
+        }
+    }
+
+    // Outcome of a completion cache lookup made for a request
+    void cache_lookup(bool hit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_if_needed()) return;
+        __atomic_fetch_add(hit ? &header_->cache_hits : &header_->cache_misses, 1, __ATOMIC_RELAXED);
+    }
+
+    void print(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_if_needed()) {
+            out << "No statistics (SHELL_COMPLETE_STATS=0 or no state directory)" << std::endl;
+            return;
+        }
+        char line[256];
+        time_t since = (time_t)header_->created;
+        char date[64] = "?";
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&since));
+        out << "Since " << date << " (" << path_ << ")\n\n";
+        snprintf(line, sizeof(line), "%-7s %-10s %-26s %7s %9s %9s %9s %9s %6s %8s %10s\n", "source", "provider",
+                 "model", "count", "p50 ms", "p90 ms", "p99 ms", "max ms", "fail", "timeout", "bytes");
+        out << line;
+        for (uint32_t i = 0; i < SERIES_COUNT; ++i) {
+            const Series& s = series_[i];
+            uint64_t count = __atomic_load_n(&s.count, __ATOMIC_RELAXED);
+            if (!__atomic_load_n(&s.key, __ATOMIC_ACQUIRE) || !count || !s.source[0]) continue;
+            uint64_t max = __atomic_load_n(&s.max_us, __ATOMIC_RELAXED);
+            snprintf(line, sizeof(line), "%-7.7s %-10.10s %-26.26s %7llu %9.3f %9.3f %9.3f %9.3f %6llu %8llu %10llu\n",
+                     s.source, s.provider[0] ? s.provider : "-", s.model[0] ? s.model : "-",
+                     (unsigned long long)count, percentile(s, count, max, 0.50) / 1000.0,
+                     percentile(s, count, max, 0.90) / 1000.0, percentile(s, count, max, 0.99) / 1000.0, max / 1000.0,
+                     (unsigned long long)__atomic_load_n(&s.failures, __ATOMIC_RELAXED),
+                     (unsigned long long)__atomic_load_n(&s.timeouts, __ATOMIC_RELAXED),
+                     (unsigned long long)__atomic_load_n(&s.bytes, __ATOMIC_RELAXED));
+            out << line;
+        }
+        uint64_t hits = __atomic_load_n(&header_->cache_hits, __ATOMIC_RELAXED);
+        uint64_t lookups = hits + __atomic_load_n(&header_->cache_misses, __ATOMIC_RELAXED);
+        snprintf(line, sizeof(line), "\nCache hit ratio: %.1f%% (%llu of %llu lookups)\n",
+                 lookups ? 100.0 * hits / lookups : 0.0, (unsigned long long)hits, (unsigned long long)lookups);
+        out << line;
+    }
+
+    // Start over with an empty file, e.g. to compare before and after a
+    // configuration change
+    bool reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_if_needed()) return false;
+        munmap(header_, file_size());
+        header_ = nullptr;
+        series_ = nullptr;
+        return create_file(true) && map_file();
+    }
+
+private:
+    static const uint32_t VERSION = 1;
+    static const uint32_t SERIES_COUNT = 32;
+    static const uint32_t SUB_BUCKET_BITS = 5;
+    static const uint32_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    // Values up to 2^32 us (over an hour); anything longer lands in the last bucket
+    static const uint32_t MAX_BITS = 32;
+    static const uint32_t BUCKET_COUNT = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t series_count;
+        uint32_t bucket_count;
+        uint32_t reserved;
+        uint64_t created;
+        uint64_t cache_hits;    // atomic
+        uint64_t cache_misses;  // atomic
+    };
+
+    struct Series {
+        uint64_t key;  // atomic; 0 = unused, else hash of the labels
+        char source[8];
+        char provider[16];
+        char model[40];
+        // All atomic
+        uint64_t count;
+        uint64_t failures;
+        uint64_t timeouts;
+        uint64_t bytes;
+        uint64_t sum_us;
+        uint64_t max_us;
+        uint64_t buckets[BUCKET_COUNT];
+    };
+
+    static size_t file_size() {
+        return sizeof(Header) + SERIES_COUNT * sizeof(Series);
+    }
+
+    static uint32_t bucket_index(uint64_t value) {
+        if (value >= (1ULL << MAX_BITS)) return BUCKET_COUNT - 1;
+        if (value < SUB_BUCKETS) return (uint32_t)value;
+        uint32_t magnitude = 63 - __builtin_clzll(value);
+        uint32_t shift = magnitude - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + (uint32_t)(value >> shift) - SUB_BUCKETS;
+    }
+
+    // Largest value that falls in bucket index
+    static uint64_t bucket_high(uint32_t index) {
+        if (index < SUB_BUCKETS) return index;
+        uint32_t shift = index / SUB_BUCKETS - 1;
+        uint64_t low = (uint64_t)(index % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        return low + (1ULL << shift) - 1;
+    }
+
+    static uint64_t percentile(const Series& s, uint64_t count, uint64_t max, double q) {
+        uint64_t rank = (uint64_t)std::ceil(q * count);
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += __atomic_load_n(&s.buckets[i], __ATOMIC_RELAXED);
+            if (seen >= rank) return std::min(bucket_high(i), max);
+        }
+        return max;
+    }
+
+    // The series for these labels, claimed on first use like a slot in
+    // the completion cache. nullptr once all series are taken.
+    Series* find_series(const char* source, const char* provider, const char* model) {
+        std::string labels = std::string(source) + '\0' + provider + '\0' + model;
+        uint64_t key = fnv1a(labels);
+        if (key == 0) key = 1;
+        for (uint32_t probe = 0; probe < SERIES_COUNT; ++probe) {
+            Series& s = series_[(key + probe) % SERIES_COUNT];
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&s.key, &expected, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                snprintf(s.source, sizeof(s.source), "%s", source);
+                snprintf(s.provider, sizeof(s.provider), "%s", provider);
+                snprintf(s.model, sizeof(s.model), "%s", model);
+                return &s;
+            }
+            if (expected == key) return &s;
+        }
+        return nullptr;
+    }
+
+    bool open_if_needed() {
+        if (header_) return true;
+        if (tried_) return false;
+        tried_ = true;
+        const char* env = std::getenv("SHELL_COMPLETE_STATS");
+        if (env && std::string(env) == "0") return false;
+        std::string dir = state_directory();
+        if (dir.empty()) return false;
+        path_ = dir + "/stats";
+        if (map_file()) return true;
+        // Missing, or a different layout: start a new one
+        return create_file(access(path_.c_str(), F_OK) == 0) && map_file();
+    }
+
+    bool map_file() {
+        int fd = open(path_.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size == file_size()) {
+            map = mmap(nullptr, file_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        const Header* h = (const Header*)map;
+        if (std::memcmp(h->magic, "SHSTATS", 8) != 0 || h->version != VERSION || h->series_count != SERIES_COUNT ||
+            h->bucket_count != BUCKET_COUNT) {
+            munmap(map, file_size());
+            return false;
+        }
+        header_ = (Header*)map;
+        series_ = (Series*)((char*)map + sizeof(Header));
+        return true;
+    }
+
+    // Write an empty file next to path_ and move it into place. Without
+    // replace, link() makes creation atomic: if another process got there
+    // first, its file is kept.
+    bool create_file(bool replace) {
+        std::string tmp = path_ + ".tmp." + std::to_string(getpid());
+        int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "SHSTATS", 8);
+        h.version = VERSION;
+        h.series_count = SERIES_COUNT;
+        h.bucket_count = BUCKET_COUNT;
+        h.created = (uint64_t)time(nullptr);
+        bool ok = ftruncate(fd, (off_t)file_size()) == 0 && pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+        close(fd);
+        if (ok) {
+            if (replace) {
+                ok = rename(tmp.c_str(), path_.c_str()) == 0;
+            } else {
+                ok = link(tmp.c_str(), path_.c_str()) == 0 || errno == EEXIST;
+            }
+        }
+        unlink(tmp.c_str());
+        return ok;
+    }
+
+    // Guards the mapping within this process; other processes only share
+    // the atomics in the file
+    std::mutex mutex_;
+    std::string path_;
+    bool tried_ = false;
+    Header* header_ = nullptr;
+    Series* series_ = nullptr;
+};
+
+static LatencyStats latency_stats;
+
+// Connection setup that a one-shot run can hand to the next one, kept in
+// $XDG_CACHE_HOME/shell_complete/connections: the address each API host
+// resolved to, fed back through CURLOPT_RESOLVE, and with libcurl 8.12 or
+// newer the TLS session tickets, imported into the share object so the
+// handshake resumes. The daemon does not need it; its connections stay up.
+class ConnectionCache {
+public:
+    // How long a remembered address is used without resolving again.
+    // libcurl does not report the record's real TTL.
+    static const long DNS_TTL_SECONDS = 3600;
+
+    // Read the file. Until this is called the cache stays inactive.
+    void load() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string dir = cache_directory();
+        if (dir.empty()) return;
+        path_ = dir + "/connections";
+        long now = (long)std::time(nullptr);
+
+        std::ifstream in(path_);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string kind;
+            fields >> kind;
+            if (kind == "dns") {
+                Address a;
+                if (fields >> a.host >> a.port >> a.ip >> a.expires && a.expires > now) addresses_.push_back(a);
+            } else if (kind == "tls") {
+                Ticket t;
+                if (fields >> t.expires >> t.key >> t.shmac >> t.data && t.expires > now) tickets_.push_back(t);
+            }
+        }
+    }
+
+    // Add the remembered addresses (and once, the TLS sessions) to a handle
+    // about to start a transfer
+    void apply(CURL* curl) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (path_.empty()) return;
+        if (!resolve_ && !addresses_.empty()) {
+            for (const Address& a : addresses_) {
+                // "+": an ordinary cache entry that expires, not a pin
+                std::string ip = a.ip.find(':') != std::string::npos ? "[" + a.ip + "]" : a.ip;
+                resolve_ = curl_slist_append(resolve_, ("+" + a.host + ":" + std::to_string(a.port) + ":" + ip).c_str());
+            }
+        }
+        if (resolve_) curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve_);
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        if (!tickets_imported_) {
+            tickets_imported_ = true;
+            for (const Ticket& t : tickets_) {
+                std::string key = from_hex(t.key), shmac = from_hex(t.shmac), data = from_hex(t.data);
+                curl_easy_ssls_import(curl, key.c_str(), (const unsigned char*)shmac.data(), shmac.size(),
+                                      (const unsigned char*)data.data(), data.size());
+            }
+        }
+#endif
+    }
+
+    // Remember where a finished transfer connected, or forget the host if
+    // the connection could not be made (the address may have moved)
+    void observe(CURL* curl, CURLcode res) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (path_.empty()) return;
+        char* url = nullptr;
+        char* ip = nullptr;
+        long port = 0;
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+        curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+        curl_easy_getinfo(curl, CURLINFO_PRIMARY_PORT, &port);
+        std::string host = url_host(url ? url : "");
+        if (host.empty()) return;
+
+        addresses_.erase(std::remove_if(addresses_.begin(), addresses_.end(),
+                                        [&](const Address& a) { return a.host == host; }),
+                         addresses_.end());
+        dirty_ = true;
+        if (res == CURLE_COULDNT_CONNECT || res == CURLE_OPERATION_TIMEDOUT || res == CURLE_SSL_CONNECT_ERROR) {
+            return;
+        }
+        if (!ip || !*ip || port <= 0) return;
+        Address a;
+        a.host = host;
+        a.port = port;
+        a.ip = ip;
+        a.expires = (long)std::time(nullptr) + DNS_TTL_SECONDS;
+        addresses_.push_back(a);
+    }
+
+    // After a failed connect: if the handle used a remembered address for
+    // its host, drop it (also from the shared DNS cache) and return true
+    // so the caller can retry with a fresh lookup
+    bool forget(CURL* curl) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        char* url = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+        std::string host = url_host(url ? url : "");
+        for (size_t i = 0; i < addresses_.size(); ++i) {
+            const Address& a = addresses_[i];
+            if (a.host != host) continue;
+            // libcurl does not copy CURLOPT_RESOLVE lists and other handles
+            // may still point at these, so they are only retired here
+            curl_slist* removal = curl_slist_append(nullptr, ("-" + a.host + ":" + std::to_string(a.port)).c_str());
+            retired_.push_back(removal);
+            curl_easy_setopt(curl, CURLOPT_RESOLVE, removal);
+            addresses_.erase(addresses_.begin() + i);
+            if (resolve_) retired_.push_back(resolve_);
+            resolve_ = nullptr;
+            dirty_ = true;
+            return true;
+        }
+        return false;
+    }
+
+    // Write the file back, with the TLS sessions currently in the share
+    void save() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (path_.empty()) return;
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        CURL* curl = acquire_handle(PROVIDER_CEREBRAS);
+        if (curl) {
+            std::vector<Ticket> exported;
+            if (curl_easy_ssls_export(curl, export_ticket, &exported) == CURLE_OK) {
+                tickets_.swap(exported);
+                dirty_ = true;
+            }
+            release_handle(PROVIDER_CEREBRAS, curl);
+        }
+#endif
+        if (!dirty_) return;
+
+        std::string tmp = path_ + "." + std::to_string(getpid());
+        {
+            std::ofstream out(tmp);
+            for (const Address& a : addresses_) {
+                out << "dns " << a.host << " " << a.port << " " << a.ip << " " << a.expires << "\n";
+            }
+            for (const Ticket& t : tickets_) {
+                out << "tls " << t.expires << " " << t.key << " " << t.shmac << " " << t.data << "\n";
+            }
+            if (!out) {
+                unlink(tmp.c_str());
+                return;
+            }
+        }
+        if (rename(tmp.c_str(), path_.c_str()) < 0) unlink(tmp.c_str());
+        dirty_ = false;
+    }
+
+    ~ConnectionCache() {
+        curl_slist_free_all(resolve_);
+        for (curl_slist* list : retired_) curl_slist_free_all(list);
+    }
+
+private:
+    struct Address {
+        std::string host;
+        long port = 0;
+        std::string ip;
+        long expires = 0;
+    };
+
+    // Stored hex-encoded: the key and session are opaque bytes
+    struct Ticket {
+        long expires = 0;
+        std::string key;
+        std::string shmac;
+        std::string data;
+    };
+
+    static std::string url_host(const std::string& url) {
+        size_t start = url.find("://");
+        if (start == std::string::npos) return "";
+        start += 3;
+        size_t end = url.find_first_of(":/", start);
+        return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    }
+
+    static std::string to_hex(const unsigned char* data, size_t len) {
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        out.reserve(len * 2);
+        for (size_t i = 0; i < len; ++i) {
+            out += digits[data[i] >> 4];
+            out += digits[data[i] & 15];
+        }
+        return out;
+    }
+
+    static std::string from_hex(const std::string& hex) {
+        std::string out;
+        for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+            out += (char)std::strtoul(hex.substr(i, 2).c_str(), nullptr, 16);
+        }
+        return out;
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    static CURLcode export_ticket(CURL*, void* userptr, const char* session_key, const unsigned char* shmac,
+                                  size_t shmac_len, const unsigned char* sdata, size_t sdata_len,
+                                  curl_off_t valid_until, int, const char*, size_t) {
+        if (valid_until <= (curl_off_t)std::time(nullptr)) return CURLE_OK;
+        Ticket t;
+        t.expires = (long)valid_until;
+        t.key = to_hex((const unsigned char*)session_key, std::strlen(session_key));
+        t.shmac = to_hex(shmac, shmac_len);
+        t.data = to_hex(sdata, sdata_len);
+        ((std::vector<Ticket>*)userptr)->push_back(t);
+        return CURLE_OK;
+    }
+#endif
+
+    std::mutex mutex_;
+    std::string path_;
+    std::vector<Address> addresses_;
+    std::vector<Ticket> tickets_;
+    curl_slist* resolve_ = nullptr;
+    // Replaced lists, which handles may still point at (see forget())
+    std::vector<curl_slist*> retired_;
+    bool tickets_imported_ = false;
+    bool dirty_ = false;
+};
+
+static ConnectionCache connection_cache;
+
+// Daemon-resident LRU cache over normalized inputs, indexed by a compressed
+// trie. Besides exact hits it finds answers cached for a shorter or longer
+// variant of the input ("find pdf" vs "find pdf files in home"), which are
+// good enough to show while the request for the actual input runs.
+class PrefixCache {
+public:
+    enum MatchKind { MISS, EXACT, NEAR };
+
+    explicit PrefixCache(size_t capacity) : capacity_(capacity) {}
+
+    MatchKind lookup(const std::string& key, std::string& completion) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (key.empty()) return MISS;
+
+        // Walk down as far as the key goes, remembering the deepest stored
+        // key that is a whole-word prefix of the input
+        const Node* node = &root_;
+        const Node* best = nullptr;
+        size_t best_length = 0;
+        size_t depth = 0;
+        while (depth < key.size()) {
+            auto it = node->children.find(key[depth]);
+            if (it == node->children.end()) break;
+            const Node* child = it->second.get();
+            size_t n = 0;
+            while (n < child->edge.size() && depth + n < key.size() && child->edge[n] == key[depth + n]) ++n;
+            if (n < child->edge.size()) {
+                // The input ends inside this edge: everything below extends it
+                if (depth + n == key.size()) {
+                    return near_match(key, best, best_length, child, key + child->edge.substr(n), completion);
+                }
+                break;
+            }
+            depth += n;
+            node = child;
+            if (node->has_value && depth < key.size() && key[depth] == ' ') {
+                best = node;
+                best_length = depth;
+            }
+        }
+
+        if (depth == key.size() && node->has_value) {
+            completion = node->completion;
+            touch(const_cast<Node*>(node));
+            return EXACT;
+        }
+        if (depth == key.size()) {
+            return near_match(key, best, best_length, node, key, completion);
+        }
+        return near_match(key, best, best_length, nullptr, "", completion);
+    }
+
+    void insert(const std::string& key, const std::string& completion) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (key.empty() || capacity_ == 0) return;
+
+        Node* node = &root_;
+        size_t depth = 0;
+        while (depth < key.size()) {
+            auto it = node->children.find(key[depth]);
+            if (it == node->children.end()) {
+                std::unique_ptr<Node> leaf(new Node);
+                leaf->edge = key.substr(depth);
+                Node* raw = leaf.get();
+                node->children[key[depth]] = std::move(leaf);
+                node = raw;
+                depth = key.size();
+                break;
+            }
+            Node* child = it->second.get();
+            size_t n = 0;
+            while (n < child->edge.size() && depth + n < key.size() && child->edge[n] == key[depth + n]) ++n;
+            if (n < child->edge.size()) {
+                // Split the edge where the key diverges
+                std::unique_ptr<Node> middle(new Node);
+                middle->edge = child->edge.substr(0, n);
+                std::unique_ptr<Node> rest = std::move(it->second);
+                rest->edge.erase(0, n);
+                middle->children[rest->edge[0]] = std::move(rest);
+                Node* raw = middle.get();
+                it->second = std::move(middle);
+                child = raw;
+            }
+            depth += n;
+            node = child;
+        }
+
+        if (node->has_value) {
+            lru_.erase(node->lru);
+        }
+        node->has_value = true;
+        node->completion = completion;
+        lru_.push_front(key);
+        node->lru = lru_.begin();
+        node->last_used = ++clock_;
+
+        while (lru_.size() > capacity_) {
+            std::string oldest = lru_.back();
+            lru_.pop_back();
+            remove(&root_, oldest, 0);
+        }
+    }
+
+private:
+    struct Node {
+        std::string edge;  // label of the edge leading into this node
+        std::map<char, std::unique_ptr<Node>> children;
+        bool has_value = false;
+        std::string completion;
+        std::list<std::string>::iterator lru;
+        uint64_t last_used = 0;
+    };
+
+    // Close enough to stand in for the input: they share at least half of
+    // the longer of the two strings
+    static bool similar(size_t shared, size_t a, size_t b) {
+        return shared * 2 >= std::max(a, b);
+    }
+
+    // Pick between the longest stored whole-word prefix of the input and
+    // the most recently used stored whole-word extension below subtree
+    MatchKind near_match(const std::string& key, const Node* prefix, size_t prefix_length,
+                         const Node* subtree, const std::string& subtree_key, std::string& completion) {
+        const Node* extension = nullptr;
+        size_t extension_length = 0;
+        if (subtree) {
+            find_extension(subtree, subtree_key, key.size(), extension, extension_length);
+        }
+        if (prefix && !similar(prefix_length, prefix_length, key.size())) prefix = nullptr;
+        if (extension && !similar(key.size(), key.size(), extension_length)) extension = nullptr;
+
+        const Node* chosen = prefix;
+        if (extension && (!prefix || extension_length - key.size() < key.size() - prefix_length)) {
+            chosen = extension;
+        }
+        if (!chosen) return MISS;
+        completion = chosen->completion;
+        touch(const_cast<Node*>(chosen));
+        return NEAR;
+    }
+
+    void find_extension(const Node* node, const std::string& node_key, size_t input_length,
+                        const Node*& best, size_t& best_length) const {
+        if (node->has_value && node_key.size() > input_length && node_key[input_length] == ' ' &&
+            (!best || node->last_used > best->last_used)) {
+            best = node;
+            best_length = node_key.size();
+        }
+        for (const auto& child : node->children) {
+            find_extension(child.second.get(), node_key + child.second->edge, input_length, best, best_length);
+        }
+    }
+
+    void touch(Node* node) {
+        lru_.splice(lru_.begin(), lru_, node->lru);
+        node->last_used = ++clock_;
+    }
+
+    // Drop key's value; returns true when node itself is now empty and can
+    // be deleted by its parent. Single-child nodes are merged back into
+    // their child to keep the trie compressed.
+    bool remove(Node* node, const std::string& key, size_t depth) {
+        if (depth == key.size()) {
+            node->has_value = false;
+            node->completion.clear();
+        } else {
+            auto it = node->children.find(key[depth]);
+            if (it == node->children.end()) return false;
+            Node* child = it->second.get();
+            if (key.compare(depth, child->edge.size(), child->edge) != 0) return false;
+            if (remove(child, key, depth + child->edge.size())) {
+                node->children.erase(it);
+            } else if (!child->has_value && child->children.size() == 1) {
+                std::unique_ptr<Node> grandchild = std::move(child->children.begin()->second);
+                grandchild->edge = child->edge + grandchild->edge;
+                it->second = std::move(grandchild);
+            }
+        }
+        return node != &root_ && !node->has_value && node->children.empty();
+    }
+
+    Node root_;
+    std::list<std::string> lru_;  // most recently used first
+    size_t capacity_;
+    uint64_t clock_ = 0;
+    std::mutex mutex_;
+};
+
+// zsh stores history "metafied": bytes that are special to the shell are
+// written as Meta (0x83) followed by the byte XOR 0x20
+std::string unmetafy(const std::string& line) {
+    std::string out;
+    out.reserve(line.size());
+    for (size_t i = 0; i < line.size(); ++i) {
+        if ((unsigned char)line[i] == 0x83 && i + 1 < line.size()) {
+            out += (char)(line[++i] ^ 0x20);
+        } else {
+            out += line[i];
+        }
+    }
+    return out;
+}
+
+// Prefix index over the user's zsh history for instant local suggestions.
+// Every distinct command is stored once in a single text blob; the items
+// pointing into it are sorted so all commands starting with a prefix form
+// one contiguous range, and each carries its score: how often it was run,
+// decayed by how many commands ago the last run was. A tournament tree
+// over the scores finds the best items of any range in O(limit * log n),
+// so a one-letter or empty prefix costs about as much as a long one.
+class HistoryIndex {
+public:
+    // Reads plain or EXTENDED_HISTORY files (": <start>:<elapsed>;cmd");
+    // multi-line commands are continued with a trailing backslash. Only
+    // commands starting with prefix are kept, for a single query.
+    bool load(const std::string& path, const std::string& prefix = std::string()) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+
+        std::map<std::string, Item> unique;
+        std::string line, command;
+        uint32_t sequence = 0;
+        bool continued = false;
+        while (std::getline(in, line)) {
+            line = unmetafy(line);
+            if (continued) {
+                command += '\n';
+            } else {
+                command.clear();
+                if (line.size() > 2 && line[0] == ':' && line[1] == ' ') {
+                    size_t semi = line.find(';');
+                    if (semi != std::string::npos) line.erase(0, semi + 1);
+                }
+            }
+            continued = !line.empty() && line.back() == '\\';
+            if (continued) line.pop_back();
+            command += line;
+            if (continued || command.empty()) continue;
+
+            ++sequence;
+            if (command.compare(0, prefix.size(), prefix) != 0) continue;
+            Item& item = unique[command];
+            ++item.count;
+            item.last = sequence;
+        }
+
+        blob_.clear();
+        items_.clear();
+        items_.reserve(unique.size());
+        for (auto& entry : unique) {
+            Item item = entry.second;
+            item.offset = (uint32_t)blob_.size();
+            item.length = (uint32_t)entry.first.size();
+            blob_ += entry.first;
+            item.score = item.count * std::pow(0.5, (sequence - item.last) / HALF_LIFE);
+            items_.push_back(item);
+        }
+
+        // Leaves at n + i, each parent holding the better of its children
+        size_t n = items_.size();
+        tree_.assign(2 * n, 0);
+        for (size_t i = 0; i < n; ++i) tree_[n + i] = (uint32_t)i;
+        for (size_t i = n; i-- > 1;) tree_[i] = better(tree_[2 * i], tree_[2 * i + 1]);
+        return true;
+    }
+
+    // Up to limit commands that extend prefix, best first
+    std::vector<std::string> query(const std::string& prefix, size_t limit) const {
+        auto item_less = [&](const Item& item, const std::string& p) {
+            return blob_.compare(item.offset, std::min<size_t>(item.length, p.size()), p) < 0;
+        };
+        auto prefix_less = [&](const std::string& p, const Item& item) {
+            return blob_.compare(item.offset, std::min<size_t>(item.length, p.size()), p) > 0;
+        };
+        size_t begin = std::lower_bound(items_.begin(), items_.end(), prefix, item_less) - items_.begin();
+        size_t end = std::upper_bound(items_.begin(), items_.end(), prefix, prefix_less) - items_.begin();
+        // The prefix itself sorts first and has nothing to add
+        if (begin < end && items_[begin].length == prefix.size()) ++begin;
+
+        // Ranges still to take from, each with its best item; taking that
+        // item splits its range in two
+        struct Range {
+            size_t best, begin, end;
+        };
+        auto worse = [&](const Range& a, const Range& b) { return better(a.best, b.best) == b.best; };
+        std::priority_queue<Range, std::vector<Range>, decltype(worse)> ranges(worse);
+        auto push = [&](size_t from, size_t to) {
+            if (from < to) ranges.push(Range{best_in(from, to), from, to});
+        };
+        push(begin, end);
+
+        std::vector<std::string> result;
+        while (result.size() < limit && !ranges.empty()) {
+            Range range = ranges.top();
+            ranges.pop();
+            const Item& item = items_[range.best];
+            result.push_back(blob_.substr(item.offset, item.length));
+            push(range.begin, range.best);
+            push(range.best + 1, range.end);
+        }
+        return result;
+    }
+
+    size_t size() const { return items_.size(); }
+
+private:
+    // A command run this many commands ago counts half
+    static constexpr double HALF_LIFE = 500;
+
+    struct Item {
+        uint32_t offset = 0;
+        uint32_t length = 0;
+        uint32_t count = 0;
+        uint32_t last = 0;
+        double score = 0;
+    };
+
+    // The higher scoring of two items; ties go to the one sorting first
+    uint32_t better(uint32_t a, uint32_t b) const {
+        if (items_[a].score != items_[b].score) return items_[a].score > items_[b].score ? a : b;
+        return std::min(a, b);
+    }
+
+    // Best item in [from, to), which must not be empty
+    uint32_t best_in(size_t from, size_t to) const {
+        size_t n = items_.size();
+        uint32_t best = (uint32_t)from;
+        for (from += n, to += n; from < to; from /= 2, to /= 2) {
+            if (from & 1) best = better(best, tree_[from++]);
+            if (to & 1) best = better(best, tree_[--to]);
+        }
+        return best;
+    }
+
+    std::string blob_;
+    std::vector<Item> items_;
+    // Tournament tree of item indexes (see load())
+    std::vector<uint32_t> tree_;
+};
+
+// History file to learn from: SHELL_COMPLETE_HISTFILE, then HISTFILE if
+// exported, then ~/.zsh_history
+std::string history_file_path() {
+    const char* env = std::getenv("SHELL_COMPLETE_HISTFILE");
+    if (!env || !*env) env = std::getenv("HISTFILE");
+    if (env && *env) return env;
+    const char* home = std::getenv("HOME");
+    return home ? std::string(home) + "/.zsh_history" : "";
+}
+
+// History index kept by the daemon, reloaded whenever the file changes
+class LocalHistory {
+public:
+    std::vector<std::string> query(const std::string& prefix, size_t limit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refresh_locked();
+        return index_.query(prefix, limit);
+    }
+
+    // Index the file ahead of the first query
+    void refresh() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refresh_locked();
+    }
+
+private:
+    void refresh_locked() {
+        std::string path = history_file_path();
+        struct stat st;
+        if (!path.empty() && stat(path.c_str(), &st) == 0 &&
+            (path != path_ || st.st_mtime != mtime_ || st.st_size != size_)) {
+            if (index_.load(path)) {
+                path_ = path;
+                mtime_ = st.st_mtime;
+                size_ = st.st_size;
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    HistoryIndex index_;
+    std::string path_;
+    time_t mtime_ = 0;
+    off_t size_ = 0;
+};
+
+static LocalHistory local_history;
+
+// How many local candidates --local and the LOCAL verb return
+static const size_t LOCAL_CANDIDATES = 5;
+
+// Names of the executables on $PATH, for completing a lone first word
+// locally. Rebuilt when PATH changes or the list is a minute old.
+class PathIndex {
+public:
+    // Shortest executable name that extends word, or ""
+    std::string complete(const std::string& word) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refresh();
+        std::string best;
+        for (auto it = std::lower_bound(names_.begin(), names_.end(), word);
+             it != names_.end() && it->compare(0, word.size(), word) == 0; ++it) {
+            if (it->size() > word.size() && (best.empty() || it->size() < best.size())) best = *it;
+        }
+        return best;
+    }
+
+private:
+    void refresh() {
+        const char* env = std::getenv("PATH");
+        std::string path = env ? env : "";
+        time_t now = time(nullptr);
+        if (path == path_ && now - loaded_at_ < 60) return;
+        path_ = path;
+        loaded_at_ = now;
+
+        names_.clear();
+        std::stringstream dirs(path);
+        std::string dir;
+        while (std::getline(dirs, dir, ':')) {
+            DIR* d = opendir(dir.empty() ? "." : dir.c_str());
+            if (!d) continue;
+            while (struct dirent* entry = readdir(d)) {
+                if (entry->d_name[0] == '.') continue;
+                std::string file = dir + "/" + entry->d_name;
+                if (access(file.c_str(), X_OK) == 0) names_.push_back(entry->d_name);
+            }
+            closedir(d);
+        }
+        std::sort(names_.begin(), names_.end());
+        names_.erase(std::unique(names_.begin(), names_.end()), names_.end());
+    }
+
+    std::mutex mutex_;
+    std::vector<std::string> names_;
+    std::string path_;
+    time_t loaded_at_ = 0;
+};
+
+static PathIndex path_index;
+
+TransferTiming transfer_timing(ProviderRequest& req, bool ok) {
+    TransferTiming t;
+    t.provider = provider_name(req.provider);
+    t.ok = ok;
+    curl_easy_getinfo(req.curl, CURLINFO_NAMELOOKUP_TIME_T, &t.dns_us);
+    curl_easy_getinfo(req.curl, CURLINFO_CONNECT_TIME_T, &t.connect_us);
+    curl_easy_getinfo(req.curl, CURLINFO_APPCONNECT_TIME_T, &t.tls_us);
+    curl_easy_getinfo(req.curl, CURLINFO_PRETRANSFER_TIME_T, &t.pretransfer_us);
+    curl_easy_getinfo(req.curl, CURLINFO_STARTTRANSFER_TIME_T, &t.first_byte_us);
+    curl_easy_getinfo(req.curl, CURLINFO_TOTAL_TIME_T, &t.total_us);
+    if (req.replayed_us >= 0) {
+        t.first_byte_us = req.replay_first_byte_us;
+        t.total_us = req.replayed_us;
+    }
+    if (req.first_text_ns) t.first_token_us = (req.first_text_ns - req.started_ns) / 1000;
+    t.input_tokens = req.input_tokens;
+    t.output_tokens = req.output_tokens;
+    return t;
+}
+
+// Completion text of a successful transfer
+std::string response_text(ProviderRequest& req) {
+    if (req.stream.parser.saw_event()) {
+        req.builder.finish();
+        return req.builder.text();
+    }
+
+    // Not an event stream: a plain JSON response (an error object, or a
+    // server that ignored "stream")
+    const std::string& body = req.stream.body;
+    JsonSpan value;
+    const char* path = req.provider == PROVIDER_CEREBRAS ? "choices.0.message.content" : "content.0.text";
+    std::string text;
+    if (json_find(body, path, value) && value.unescape_into(text)) {
+        if (json_find(body, "usage", value)) req.read_usage(value);
+        return text;
+    }
+    if (json_find(body, "error", value)) {
+        std::cerr << "API error: " << value.raw() << std::endl;
+    } else if (!json_well_formed(body)) {
+        std::cerr << "JSON parse error: unexpected response body" << std::endl;
+    }
+
+    return "";
+}
+
+// Completion text of a finished transfer, or "" on failure
+std::string finish_request(ProviderRequest& req, CURLcode res) {
+    // Superseded by a newer request: not the provider's fault, so nothing
+    // to record against its latency
+    if (res == CURLE_ABORTED_BY_CALLBACK && req.cancel.cancelled()) {
+        return "";
+    }
+    // A write error is how we cut the stream off once the command is complete
+    bool ok = res == CURLE_OK || (res == CURLE_WRITE_ERROR && req.builder.done());
+    bool live = req.replayed_us < 0;
+    if (live) {
+        // A replayed request says nothing about the network or the provider
+        connection_cache.observe(req.curl, res);
+        if (res == CURLE_OK || res == CURLE_WRITE_ERROR) note_contact(req.provider, req.curl);
+        latency_tracker.record(req.provider, req.curl, ok);
+    }
+    if (req.stream.record && (res == CURLE_OK || res == CURLE_WRITE_ERROR)) http_fixtures.record(req);
+    std::string text;
+    if (ok) {
+        text = response_text(req);
+    } else {
+        std::cerr << provider_name(req.provider) << ": request failed: " << curl_easy_strerror(res) << std::endl;
+    }
+
+    // An error status still transfers fine; what counts is getting an answer
+    curl_off_t total_us = 0, down = 0, up = 0;
+    curl_easy_getinfo(req.curl, CURLINFO_TOTAL_TIME_T, &total_us);
+    curl_easy_getinfo(req.curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    curl_easy_getinfo(req.curl, CURLINFO_SIZE_UPLOAD_T, &up);
+    if (!live) total_us = req.replayed_us;
+    latency_stats.record("remote", provider_name(req.provider), provider_model(req.provider), total_us,
+                         !text.empty(), res == CURLE_OPERATION_TIMEDOUT, (uint64_t)(down + up));
+
+    if (timing_json || startup_profile) {
+        TransferTiming timing = transfer_timing(req, ok);
+        if (timing_json) print_timing_json(timing);
+        if (startup_profile) startup_profile->transfer(timing);
+    }
+    return text;
+}
+
+// The daemon's transport: one thread that owns a multi handle with
+// HTTP/2 multiplexing, on which the transfers of every client connection
+// run side by side. Together with the share object this means concurrent
+// completions from many terminals ride a single connection per provider.
+// Transfers are added and removed through a TransferGroup; callbacks
+// (streamed text, progress) run on the transport thread.
+class TransferGroup;
+
+class Transport {
+public:
+    void start() {
+        multi_ = curl_multi_init();
+        curl_multi_setopt(multi_, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+        thread_ = std::thread(&Transport::run, this);
+    }
+
+    void stop() {
+        if (!multi_) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        curl_multi_wakeup(multi_);
+        thread_.join();
+        curl_multi_cleanup(multi_);
+        multi_ = nullptr;
+    }
+
+    bool running() const { return multi_ != nullptr; }
+
+private:
+    friend class TransferGroup;
+
+    struct Entry {
+        ProviderRequest* req;
+        TransferGroup* group;
+    };
+
+    void add(ProviderRequest* req, TransferGroup* group) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            incoming_.push_back(Entry{req, group});
+        }
+        curl_multi_wakeup(multi_);
+    }
+
+    // Blocks until req is no longer in the multi handle (a no-op if it
+    // already finished), so its callbacks can no longer run
+    void remove(ProviderRequest* req) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < incoming_.size(); ++i) {
+            if (incoming_[i].req == req) {
+                incoming_.erase(incoming_.begin() + i);
+                return;
+            }
+        }
+        if (active_.find(req->curl) == active_.end()) return;
+        removals_.push_back(req->curl);
+        curl_multi_wakeup(multi_);
+        removed_.wait(lock, [&]() { return active_.find(req->curl) == active_.end(); });
+    }
+
+    void run();
+
+    CURLM* multi_ = nullptr;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable removed_;
+    std::vector<Entry> incoming_;
+    std::vector<CURL*> removals_;
+    std::map<CURL*, Entry> active_;
+    bool stopping_ = false;
+};
+
+static Transport transport;
+
+// The transfers one caller is waiting on. They run on the daemon's
+// transport when it is up, otherwise on a multi handle of their own that
+// is driven from wait().
+class TransferGroup {
+public:
+    TransferGroup() : multi_(transport.running() ? nullptr : curl_multi_init()) {}
+
+    ~TransferGroup() {
+        std::vector<ProviderRequest*> pending(added_);
+        for (ProviderRequest* req : pending) remove(*req);
+        if (multi_) curl_multi_cleanup(multi_);
+    }
+
+    void add(ProviderRequest& req) {
+        connection_cache.apply(req.curl);
+        added_.push_back(&req);
+        if (multi_) {
+            curl_multi_add_handle(multi_, req.curl);
+        } else {
+            transport.add(&req, this);
+        }
+    }
+
+    // Stop a transfer that has not finished yet
+    void remove(ProviderRequest& req) {
+        auto it = std::find(added_.begin(), added_.end(), &req);
+        if (it == added_.end()) return;
+        added_.erase(it);
+        if (multi_) {
+            curl_multi_remove_handle(multi_, req.curl);
+        } else {
+            transport.remove(&req);
+            std::lock_guard<std::mutex> lock(transport.mutex_);
+            finished_.erase(std::remove(finished_.begin(), finished_.end(), &req), finished_.end());
+        }
+    }
+
+    // Transfers that finished within timeout_ms, with their result set.
+    // They are no longer part of the group.
+    std::vector<ProviderRequest*> wait(int timeout_ms) {
+        std::vector<ProviderRequest*> done;
+        if (multi_) {
+            collect(done);
+            if (done.empty()) {
+                curl_multi_wait(multi_, nullptr, 0, timeout_ms, nullptr);
+                collect(done);
+            }
+        } else {
+            std::unique_lock<std::mutex> lock(transport.mutex_);
+            finished_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]() { return !finished_.empty(); });
+            done.swap(finished_);
+        }
+        for (ProviderRequest* req : done) {
+            added_.erase(std::remove(added_.begin(), added_.end(), req), added_.end());
+        }
+        return done;
+    }
+
+    TransferGroup(const TransferGroup&) = delete;
+    TransferGroup& operator=(const TransferGroup&) = delete;
+
+private:
+    friend class Transport;
+
+    void collect(std::vector<ProviderRequest*>& done) {
+        int running = 0;
+        curl_multi_perform(multi_, &running);
+        CURLMsg* msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi_, &queued))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            for (ProviderRequest* req : added_) {
+                if (req->curl != msg->easy_handle) continue;
+                curl_multi_remove_handle(multi_, req->curl);
+                req->result = msg->data.result;
+                done.push_back(req);
+            }
+        }
+    }
+
+    CURLM* multi_;
+    std::vector<ProviderRequest*> added_;
+    // Filled by the transport thread under transport.mutex_
+    std::vector<ProviderRequest*> finished_;
+    std::condition_variable finished_cv_;
+};
+
+void Transport::run() {
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) break;
+            for (const Entry& entry : incoming_) {
+                curl_multi_add_handle(multi_, entry.req->curl);
+                active_[entry.req->curl] = entry;
+            }
+            incoming_.clear();
+            for (CURL* curl : removals_) {
+                curl_multi_remove_handle(multi_, curl);
+                active_.erase(curl);
+            }
+            if (!removals_.empty()) removed_.notify_all();
+            removals_.clear();
+        }
+
+        int running = 0;
+        curl_multi_perform(multi_, &running);
+        CURLMsg* msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi_, &queued))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = active_.find(msg->easy_handle);
+            if (it == active_.end()) continue;
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi_, it->first);
+            Entry entry = it->second;
+            active_.erase(it);
+            // A removal that lost the race must not hit the handle once it
+            // is back in the pool and running another request
+            removals_.erase(std::remove(removals_.begin(), removals_.end(), entry.req->curl), removals_.end());
+            entry.req->result = result;
+            entry.group->finished_.push_back(entry.req);
+            entry.group->finished_cv_.notify_all();
+            removed_.notify_all();
+        }
+        curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : active_) curl_multi_remove_handle(multi_, entry.first);
+    active_.clear();
+    removed_.notify_all();
+}
+
+// Run one prepared request to completion. Outside the daemon a request
+// that cannot be cancelled simply uses curl_easy_perform() (only ever from
+// one thread at a time, see acquire_handle()); otherwise it
+// goes through a TransferGroup, checking the token on every wakeup because
+// libcurl only calls the progress callback about once a second while
+// waiting for the first byte.
+CURLcode perform_request(ProviderRequest& req) {
+    CURLcode res;
+    if (http_fixtures.replaying() && http_fixtures.replay(req, res)) return res;
+
+    if (!req.cancel && !transport.running()) {
+        connection_cache.apply(req.curl);
+        res = curl_easy_perform(req.curl);
+        if (res == CURLE_COULDNT_CONNECT && connection_cache.forget(req.curl)) {
+            // The remembered address went stale; nothing was received yet
+            res = curl_easy_perform(req.curl);
+        }
+        return res;
+    }
+
+    TransferGroup group;
+    group.add(req);
+    for (;;) {
+        if (!group.wait(50).empty()) return req.result;
+        if (req.cancel.cancelled()) break;
+    }
+    // The handle goes back to the pool either way. Over HTTP/2 only the
+    // abandoned stream is reset and the connection stays in the cache.
+    group.remove(req);
+    return CURLE_ABORTED_BY_CALLBACK;
+}
+
+std::string call_provider(Provider provider, const std::string& command_line,
+                          const ChunkCallback& on_chunk = ChunkCallback(),
+                          const CancelToken& cancel = CancelToken()) {
+    std::unique_ptr<ProviderRequest> req = prepare_request(provider, command_line, on_chunk, cancel);
+    if (!req) {
         return "";
     }
+    CURLcode res = perform_request(*req);
+    return finish_request(*req, res);
+}
 
-    // Build JSON payload using nlohmann::json
-    json request;
-    request["model"] = "gpt-oss-120b";
-    request["max_tokens"] = 65536;
-    request["temperature"] = 0.75;
-    request["reasoning_effort"] = "medium";
-    request["messages"] = json::array({
-        {{"role", "system"}, {"content", "You complete shell commands. Return ONLY the complete command, no explanations.\n\n"
-                                         "Current OS: MacOS\nCurrent Shell: Zsh\n"
-                                         "Examples:\n"
-                                         "Input: list all files\n"
-                                         "Output: ls -la\n\n"
-                                         "Input: find pdf files\n"
-                                         "Output: find . -name \"*.pdf\"\n\n"
-                                         "Input: compress logs\n"
-                                         "Output: tar -czf logs.tar.gz *.log"}},
-        {{"role", "user"}, {"content", "Input: " + command_line + "\nOutput:"}}
-    });
+std::string call_llm_cerebras(const std::string& command_line, const ChunkCallback& on_chunk = ChunkCallback()) {
+    return call_provider(PROVIDER_CEREBRAS, command_line, on_chunk);
+}
+
+std::string call_llm(const std::string& command_line, const ChunkCallback& on_chunk = ChunkCallback()) {
+    return call_provider(PROVIDER_ANTHROPIC, command_line, on_chunk);
+}
 
-    std::string json_payload = request.dump();
-    std::string response;
+// Hedged request: start the primary provider and, if it has not delivered
+// a first byte within delay_ms (immediately when delay_ms is 0), race the
+// secondary against it in one TransferGroup. The first non-empty completion
+// wins and the other transfer is cancelled. Streamed text is only passed
+// on from whichever request produced text first, and once one has, only
+// its completion is returned unless it fails, so the final answer always
+// continues the text already streamed.
+std::string call_hedged(Provider primary, Provider secondary, long delay_ms,
+                        const std::string& command_line, const ChunkCallback& on_chunk = ChunkCallback(),
+                        const CancelToken& cancel = CancelToken()) {
+    // Written from the transport thread when the daemon runs one
+    std::atomic<int> leader(-1);
+    auto relay_from = [&](int index) -> ChunkCallback {
+        if (!on_chunk) return ChunkCallback();
+        return [&leader, &on_chunk, index](const std::string& piece) {
+            int none = -1;
+            leader.compare_exchange_strong(none, index);
+            if (leader == index) on_chunk(piece);
+        };
+    };
 
-    // Initialize curl
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        std::cerr << "Failed to initialize curl" << std::endl;
-        return "";
+    std::unique_ptr<ProviderRequest> reqs[2];
+    reqs[0] = prepare_request(primary, command_line, relay_from(0), cancel);
+    if (!reqs[0]) {
+        return call_provider(secondary, command_line, on_chunk, cancel);
     }
 
-    // Set curl options
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, ("Authorization: Bearer " + std::string(api_key)).c_str());
+    // Declared after reqs: its destructor cancels whatever is still running
+    TransferGroup group;
+    group.add(*reqs[0]);
+    bool active[2] = {true, false};
+    bool secondary_launched = false;
 
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.cerebras.ai/v1/chat/completions");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_payload.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    auto launch_secondary = [&]() {
+        secondary_launched = true;
+        reqs[1] = prepare_request(secondary, command_line, relay_from(1), cancel);
+        if (reqs[1]) {
+            group.add(*reqs[1]);
+            active[1] = true;
+        }
+    };
+    if (delay_ms <= 0) launch_secondary();
 
-    // Perform request
-    CURLcode res = curl_easy_perform(curl);
+    std::string completion, held;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&]() {
+        return (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    };
+    while (completion.empty() && (active[0] || active[1])) {
+        int wait_ms = 100;
+        if (!secondary_launched) wait_ms = (int)std::max(1L, std::min(100L, delay_ms - elapsed_ms()));
+        for (ProviderRequest* req : group.wait(wait_ms)) {
+            int i = req == reqs[1].get() ? 1 : 0;
+            active[i] = false;
+            std::string text = finish_request(*req, req->result);
+            if (text.empty()) {
+                if (leader == i) {
+                    // The streaming leader failed; let the other one take over
+                    leader = -1;
+                    completion = held;
+                }
+            } else if (leader == -1 || leader == i) {
+                if (completion.empty()) completion = text;
+            } else {
+                // The client has the other request's text so far, so this
+                // one only counts if that request fails
+                held = text;
+            }
+        }
+        if (!completion.empty() || cancel.cancelled()) break;
 
-    // Cleanup
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+        if (!secondary_launched) {
+            if (elapsed_ms() >= delay_ms && !reqs[0]->stream.got_data) {
+                launch_secondary();
+            } else if (!active[0]) {
+                // Primary failed before the hedge delay: fall over at once
+                launch_secondary();
+            }
+        }
+    }
+    return completion;
+}
 
-    if (res != CURLE_OK) {
-        std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-        return "";
+static bool has_api_key(Provider provider) {
+    return std::getenv(provider == PROVIDER_ANTHROPIC ? "ANTHROPIC_API_KEY" : "CEREBRAS_API_KEY") != nullptr;
+}
+
+// Primary provider from SHELL_COMPLETE_PROVIDER: cerebras (default),
+// anthropic, or auto to pick whichever has had the lowest latency recently
+Provider configured_provider() {
+    const char* env = std::getenv("SHELL_COMPLETE_PROVIDER");
+    std::string name = env ? env : "";
+    if (name == "anthropic") {
+        return PROVIDER_ANTHROPIC;
+    }
+    if (name == "auto") {
+        bool allowed[PROVIDER_COUNT];
+        for (int p = 0; p < PROVIDER_COUNT; ++p) allowed[p] = has_api_key((Provider)p);
+        return latency_tracker.choose(allowed);
+    }
+    return PROVIDER_CEREBRAS;
+}
+
+// Completion through the configured provider. When SHELL_COMPLETE_HEDGE_MS
+// is set and both API keys are available the request is hedged against the
+// other provider after that many milliseconds (0 races both at once).
+std::string complete_remote(const std::string& command_line, const ChunkCallback& on_chunk,
+                            const CancelToken& cancel = CancelToken()) {
+    Provider primary = configured_provider();
+    Provider secondary = primary == PROVIDER_CEREBRAS ? PROVIDER_ANTHROPIC : PROVIDER_CEREBRAS;
+
+    const char* hedge = std::getenv("SHELL_COMPLETE_HEDGE_MS");
+    // Hedging depends on live timing, so replayed fixtures go to one provider
+    if (hedge && *hedge && has_api_key(PROVIDER_CEREBRAS) && has_api_key(PROVIDER_ANTHROPIC) &&
+        !http_fixtures.replaying()) {
+        return call_hedged(primary, secondary, std::atol(hedge), command_line, on_chunk, cancel);
+    }
+    return call_provider(primary, command_line, on_chunk, cancel);
+}
+
+// Cached answer if there is one, otherwise a remote completion that is
+// then added to the cache
+std::string complete_command(const std::string& command_line, const ChunkCallback& on_chunk = ChunkCallback(),
+                             const CancelToken& cancel = CancelToken()) {
+    std::string key = completion_cache_key(command_line);
+    std::string completion;
+    long long lookup_ns = steady_ns();
+    bool hit = completion_cache.lookup(key, completion);
+    latency_stats.cache_lookup(hit);
+    if (hit) {
+        latency_stats.record("cache", "", "", (steady_ns() - lookup_ns) / 1000, true);
+        if (on_chunk) on_chunk(completion);
+        return completion;
+    }
+
+    completion = complete_remote(command_line, on_chunk, cancel);
+    if (!completion.empty()) {
+        completion_cache.insert(key, completion);
     }
+    return completion;
+}
 
-    // Parse JSON response using nlohmann::json (OpenAI-compatible format)
-    try {
-        auto j = json::parse(response);
-        if (j.contains("choices") && j["choices"].is_array() && !j["choices"].empty()) {
-            if (j["choices"][0].contains("message") && j["choices"][0]["message"].contains("content")) {
-                return j["choices"][0]["message"]["content"].get<std::string>();
+// Opens provider connections ahead of the first completion, so the TCP
+// connect and TLS handshake are done by the time the user asks. A HEAD
+// request for the API origin costs no tokens and needs no key; it leaves
+// a live connection in the share object (and, in one-shot mode, fresh
+// entries in the connection cache) for the real request to reuse. A
+// connection that is already up only sees one more round trip on it,
+// which also keeps it from idling out.
+class Prewarmer {
+public:
+    // Providers whose connection has been quiet this long get warmed
+    static const long long IDLE_MS = 30 * 1000;
+
+    // Warm the providers the next completion may go to, skipping any that
+    // answered within IDLE_MS unless force is set. With wait false each
+    // runs on a detached thread and this returns at once.
+    void warm(bool force, bool wait) {
+        // Replayed requests never touch the network
+        if (http_fixtures.replaying()) return;
+        std::vector<std::thread> threads;
+        for (Provider provider : targets()) {
+            if (!force && steady_ms() - last_contact_ms[provider] < IDLE_MS) continue;
+            if (in_flight_[provider].exchange(true)) continue;
+            threads.emplace_back([this, provider]() {
+                warm_one(provider);
+                in_flight_[provider] = false;
+            });
+        }
+        for (std::thread& t : threads) {
+            if (wait) {
+                t.join();
+            } else {
+                t.detach();
             }
         }
-    } catch (const json::exception& e) {
-        std::cerr << "JSON parse error: " << e.what() << std::endl;
     }
 
-    return "";
+private:
+    // The configured provider, and the hedge partner when hedging is on
+    static std::vector<Provider> targets() {
+        std::vector<Provider> providers;
+        Provider primary = configured_provider();
+        providers.push_back(primary);
+        const char* hedge = std::getenv("SHELL_COMPLETE_HEDGE_MS");
+        if (hedge && *hedge && has_api_key(PROVIDER_CEREBRAS) && has_api_key(PROVIDER_ANTHROPIC)) {
+            providers.push_back(primary == PROVIDER_CEREBRAS ? PROVIDER_ANTHROPIC : PROVIDER_CEREBRAS);
+        }
+        return providers;
+    }
+
+    static void warm_one(Provider provider) {
+        ProviderRequest req(provider, std::vector<std::string>(), ChunkCallback());
+        req.curl = acquire_handle(provider);
+        if (!req.curl) return;
+        set_endpoint(req.curl, provider_origin(provider));
+        curl_easy_setopt(req.curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(req.curl, CURLOPT_TIMEOUT_MS, 10000L);
+        CURLcode res = perform_request(req);
+        connection_cache.observe(req.curl, res);
+        if (res == CURLE_OK) note_contact(provider, req.curl);
+    }
+
+    std::atomic<bool> in_flight_[PROVIDER_COUNT] = {};
+};
+
+static Prewarmer prewarmer;
+
+// Per-user Unix socket the completion daemon listens on.
+// SHELL_COMPLETE_SOCKET overrides; otherwise $XDG_RUNTIME_DIR is preferred
+// because it is private to the user, with /tmp as the fallback.
+std::string daemon_socket_path() {
+    const char* override_path = std::getenv("SHELL_COMPLETE_SOCKET");
+    if (override_path && *override_path) {
+        return override_path;
+    }
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        return std::string(runtime_dir) + "/shell_complete.sock";
+    }
+    return "/tmp/shell_complete-" + std::to_string(getuid()) + ".sock";
 }
 
-std::string call_llm(const std::string& command_line) {
-    const char* api_key = std::getenv("ANTHROPIC_API_KEY");
-    if (!api_key) {
-        std::cerr << "Error: ANTHROPIC_API_KEY not set" << std::endl;
-        return "";
+static bool fill_socket_address(const std::string& path, sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
     }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
 
-    // Build JSON payload using nlohmann::json
-    json request;
-    request["model"] = "claude-haiku-4-5-20251001";
-    request["max_tokens"] = 150;
-    request["system"] = "Your task is to complete shell commands or create the command the user describe. Return ONLY the complete command, no additional comments or explanations.\n\n"
-                        "Current OS: MacOS\nCurrent Shell: Zsh\n"
-                        "Examples:\n"
-                        "Input: list all files\n"
-                        "Output: ls -la\n\n"
-                        "Input: find pdf files\n"
-                        "Output: find . -name \"*.pdf\"\n\n"
-                        "Input: compress logs\n"
-                        "Output: tar -czf logs.tar.gz *.log";
-    request["messages"] = json::array({
-        {{"role", "user"}, {"content", "Input: " + command_line + "\nOutput:"}}
-    });
+static int connect_daemon_socket(const std::string& path) {
+    sockaddr_un addr;
+    if (!fill_socket_address(path, addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
 
-    std::string json_payload = request.dump();
-    std::string response;
+// Wire protocol spoken on the daemon socket by shell_complete and by the
+// zsh plugin (through zsocket/sysread/syswrite). Every message is a frame:
+//
+//     <VERB> [key=value ...] <length>\n<length bytes of payload>
+//
+// Clients send COMPLETE with the command line as payload. The daemon
+// answers OK with the completion (possibly empty) or ERR with an error
+// message. STREAM works the same way, except that the daemon first sends
+// one PART frame per piece of text as the model produces it; the final OK
+// frame still carries the whole completion. A request with the field
+// provisional=1 may also get one PROVISIONAL frame ahead of the answer:
+// the best suggestion from local sources (a similar earlier input, the
+// user's history, executables on PATH), with a source=<name> field, sent
+// while the model is still working. COMPLETE and STREAM requests may carry
+// session=<id> and gen=<n>: once a request with a higher gen arrives for
+// the same session, the older one is abandoned mid-flight and answered
+// with ERR "cancelled". PREWARM (empty payload) has the daemon open the
+// provider connections in the background and is answered with an empty OK
+// right away. LOCAL asks for
+// commands from the user's history that extend the payload; they come back
+// in one OK frame, best first, separated by newlines. A connection may
+// carry any number of request/response pairs.
+// Lengths count bytes, not characters.
+struct Frame {
+    std::string verb;
+    std::vector<std::pair<std::string, std::string>> fields;
+    std::string payload;
 
-    // Initialize curl
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        std::cerr << "Failed to initialize curl" << std::endl;
+    std::string field(const std::string& key) const {
+        for (const auto& f : fields) {
+            if (f.first == key) return f.second;
+        }
         return "";
     }
+};
 
-    // Set curl options
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, ("x-api-key: " + std::string(api_key)).c_str());
-    headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
-
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.anthropic.com/v1/messages");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_payload.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-    // Perform request
-    CURLcode res = curl_easy_perform(curl);
-
-    // Cleanup
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-
-    if (res != CURLE_OK) {
-        std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-        return "";
+static const size_t MAX_FRAME_HEADER = 1024;
+static const size_t MAX_FRAME_PAYLOAD = 64 * 1024;
+
+bool write_frame(int fd, const Frame& frame) {
+    std::string out = frame.verb;
+    for (const auto& f : frame.fields) {
+        out += " " + f.first + "=" + f.second;
     }
+    out += " " + std::to_string(frame.payload.size()) + "\n";
+    out += frame.payload;
+    return write_all(fd, out.data(), out.size());
+}
 
-    // Parse JSON response using nlohmann::json
-    try {
-        auto j = json::parse(response);
-        if (j.contains("content") && j["content"].is_array() && !j["content"].empty()) {
-            if (j["content"][0].contains("text")) {
-                return j["content"][0]["text"].get<std::string>();
-            }
+// Buffered reader so a header line and its payload can arrive in any
+// number of read() calls.
+class FrameReader {
+public:
+    explicit FrameReader(int fd) : fd_(fd) {}
+
+    // Returns false on EOF, I/O error or a malformed frame
+    bool read_frame(Frame& frame) {
+        size_t newline;
+        while ((newline = buffer_.find('\n')) == std::string::npos) {
+            if (buffer_.size() > MAX_FRAME_HEADER || !fill()) return false;
+        }
+        std::istringstream header(buffer_.substr(0, newline));
+        buffer_.erase(0, newline + 1);
+
+        std::vector<std::string> tokens;
+        std::string token;
+        while (header >> token) tokens.push_back(token);
+        if (tokens.size() < 2) return false;
+
+        char* end = nullptr;
+        unsigned long length = std::strtoul(tokens.back().c_str(), &end, 10);
+        if (*end != '\0' || length > MAX_FRAME_PAYLOAD) return false;
+
+        frame.verb = tokens.front();
+        frame.fields.clear();
+        for (size_t i = 1; i + 1 < tokens.size(); ++i) {
+            size_t eq = tokens[i].find('=');
+            if (eq == std::string::npos) return false;
+            frame.fields.emplace_back(tokens[i].substr(0, eq), tokens[i].substr(eq + 1));
+        }
+
+        while (buffer_.size() < length) {
+            if (!fill()) return false;
+        }
+        frame.payload = buffer_.substr(0, length);
+        buffer_.erase(0, length);
+        return true;
+    }
+
+private:
+    bool fill() {
+        char buf[4096];
+        for (;;) {
+            ssize_t n = read(fd_, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buffer_.append(buf, (size_t)n);
+            return true;
         }
-    } catch (const json::exception& e) {
-        std::cerr << "JSON parse error: " << e.what() << std::endl;
     }
 
+    int fd_;
+    std::string buffer_;
+};
+
+// Only serve connections from our own user: the daemon holds the API keys
+static bool peer_is_same_user(int fd) {
+#if defined(__linux__)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return false;
+    }
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) < 0) {
+        return false;
+    }
+    return uid == getuid();
+#endif
+}
+
+// Recent answers held by the daemon, SHELL_COMPLETE_RECENT entries (512)
+static PrefixCache recent_completions(std::getenv("SHELL_COMPLETE_RECENT")
+                                          ? std::strtoul(std::getenv("SHELL_COMPLETE_RECENT"), nullptr, 10)
+                                          : 512);
+
+// First suggestion from sources that answer without the network, tried
+// best first until one answers or the frame budget runs out
+// (SHELL_COMPLETE_LOCAL_BUDGET_MS, default 16). Sets source to the one used.
+std::string local_suggestion(const std::string& input, std::string& source) {
+    const char* env = std::getenv("SHELL_COMPLETE_LOCAL_BUDGET_MS");
+    long budget_ms = env ? std::atol(env) : 16;
+    auto start = std::chrono::steady_clock::now();
+    auto within_budget = [&]() {
+        return std::chrono::steady_clock::now() - start < std::chrono::milliseconds(budget_ms);
+    };
+
+    std::string suggestion;
+    if (recent_completions.lookup(normalize_input(input), suggestion) == PrefixCache::NEAR) {
+        source = "recent";
+        return suggestion;
+    }
+    if (within_budget()) {
+        std::vector<std::string> history = local_history.query(input, 1);
+        if (!history.empty()) {
+            source = "history";
+            return history[0];
+        }
+    }
+    std::string word = normalize_input(input);
+    if (within_budget() && !word.empty() && word.find(' ') == std::string::npos) {
+        suggestion = path_index.complete(word);
+        if (!suggestion.empty()) {
+            source = "path";
+            return suggestion;
+        }
+    }
     return "";
 }
 
+// Newest request generation seen from each client session. Each shell
+// numbers its requests, so when the user keeps typing the request for the
+// older buffer can be dropped instead of running to completion.
+class SessionGenerations {
+public:
+    // Token for a request; it is cancelled as soon as a later generation
+    // arrives for the session (or right away if one already has)
+    CancelToken begin(const std::string& session, uint64_t generation) {
+        std::shared_ptr<std::atomic<uint64_t>> latest;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            expire_idle_locked(now);
+            Session& slot = sessions_[session];
+            // Session ids are unique per plugin load and the counter never
+            // goes back, so a generation below the newest is a request
+            // that arrived late (connections are served on threads of
+            // their own) and gets a token that is already cancelled
+            if (!slot.latest) slot.latest = std::make_shared<std::atomic<uint64_t>>(0);
+            slot.last_used = now;
+            latest = slot.latest;
+        }
+        uint64_t seen = latest->load();
+        while (seen < generation && !latest->compare_exchange_weak(seen, generation)) {
+        }
+        return CancelToken(latest, generation);
+    }
+
+private:
+    struct Session {
+        std::shared_ptr<std::atomic<uint64_t>> latest;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    // Sessions idle for ten minutes are forgotten, checked once a minute
+    void expire_idle_locked(std::chrono::steady_clock::time_point now) {
+        if (now - last_sweep_ < std::chrono::minutes(1)) return;
+        last_sweep_ = now;
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            if (now - it->second.last_used > std::chrono::minutes(10)) {
+                it = sessions_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::map<std::string, Session> sessions_;
+    std::chrono::steady_clock::time_point last_sweep_;
+};
+
+static SessionGenerations session_generations;
+
+// Answer a COMPLETE or STREAM request. An exact hit in recent_completions
+// is returned at once. If the client asked for provisional=1, the remote
+// request starts on its own thread while local_suggestion() looks for a
+// quick answer to send ahead as PROVISIONAL.
+static std::string daemon_complete(const std::function<bool(const Frame&)>& send, const Frame& request,
+                                   const ChunkCallback& on_chunk, const CancelToken& cancel) {
+    std::string key = normalize_input(request.payload);
+    std::string completion;
+    long long lookup_ns = steady_ns();
+    if (recent_completions.lookup(key, completion) == PrefixCache::EXACT) {
+        latency_stats.cache_lookup(true);
+        latency_stats.record("cache", "", "", (steady_ns() - lookup_ns) / 1000, true);
+        if (on_chunk) on_chunk(completion);
+        return completion;
+    }
+
+    if (request.field("provisional") == "1") {
+        std::atomic<bool> remote_done(false);
+        std::thread remote([&]() {
+            completion = complete_command(request.payload, on_chunk, cancel);
+            remote_done = true;
+        });
+        std::string source;
+        long long local_ns = steady_ns();
+        std::string provisional = local_suggestion(request.payload, source);
+        latency_stats.record("local", "", "", (steady_ns() - local_ns) / 1000, !provisional.empty());
+        // Not worth sending if the real answer already came (cache hit)
+        if (!provisional.empty() && !remote_done && !cancel.cancelled()) {
+            Frame frame;
+            frame.verb = "PROVISIONAL";
+            frame.fields.emplace_back("source", source);
+            frame.payload = provisional;
+            send(frame);
+        }
+        remote.join();
+    } else {
+        completion = complete_command(request.payload, on_chunk, cancel);
+    }
+
+    if (!completion.empty()) {
+        recent_completions.insert(key, completion);
+    }
+    return completion;
+}
+
+// PART frames of one STREAM request. The pieces are decoded on the
+// daemon's transport thread, which every session's transfers share, so a
+// client that stops reading must not block it: pieces are queued here and
+// written by a thread of the request's own.
+class PartWriter {
+public:
+    explicit PartWriter(const std::function<bool(const Frame&)>& send)
+        : send_(send), thread_(&PartWriter::run, this) {}
+
+    // Returns once every queued piece has been written (or the client is gone)
+    ~PartWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        ready_.notify_one();
+        thread_.join();
+    }
+
+    void push(const std::string& piece) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(piece);
+        }
+        ready_.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            ready_.wait(lock, [this]() { return done_ || !pending_.empty(); });
+            if (pending_.empty()) return;
+            std::vector<std::string> pieces;
+            pieces.swap(pending_);
+            lock.unlock();
+            for (const std::string& piece : pieces) {
+                Frame part;
+                part.verb = "PART";
+                part.payload = piece;
+                send_(part);
+            }
+            lock.lock();
+        }
+    }
+
+    std::function<bool(const Frame&)> send_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::vector<std::string> pending_;
+    bool done_ = false;
+    // Last, so it starts once everything above is set up
+    std::thread thread_;
+};
+
+static void serve_client(int fd) {
+    if (!peer_is_same_user(fd)) {
+        close(fd);
+        return;
+    }
+
+    // PART frames are written from their PartWriter's thread
+    std::mutex write_mutex;
+    bool client_gone = false;
+    auto send = [&](const Frame& frame) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        if (!client_gone && !write_frame(fd, frame)) client_gone = true;
+        return !client_gone;
+    };
+
+    FrameReader reader(fd);
+    Frame request;
+    while (reader.read_frame(request)) {
+        completion_cache.reopen_if_replaced();
+        Frame response;
+        if (request.verb == "COMPLETE" || request.verb == "STREAM") {
+            CancelToken cancel;
+            std::string session = request.field("session");
+            if (!session.empty()) {
+                cancel = session_generations.begin(session, std::strtoull(request.field("gen").c_str(), nullptr, 10));
+            }
+            ChunkCallback on_chunk;
+            std::unique_ptr<PartWriter> parts;
+            if (request.verb == "STREAM") {
+                parts.reset(new PartWriter(send));
+                PartWriter* writer = parts.get();
+                on_chunk = [writer](const std::string& piece) { writer->push(piece); };
+            }
+            response.verb = "OK";
+            if (!cancel.cancelled()) {
+                response.payload = daemon_complete(send, request, on_chunk, cancel);
+            }
+            // Every PART goes out before the final frame
+            parts.reset();
+            if (response.payload.empty() && cancel.cancelled()) {
+                response.verb = "ERR";
+                response.payload = "cancelled";
+            }
+        } else if (request.verb == "PREWARM") {
+            response.verb = "OK";
+            prewarmer.warm(false, false);
+        } else if (request.verb == "LOCAL") {
+            response.verb = "OK";
+            std::vector<std::string> candidates = local_history.query(request.payload, LOCAL_CANDIDATES);
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                if (i > 0) response.payload += '\n';
+                response.payload += candidates[i];
+            }
+        } else {
+            response.verb = "ERR";
+            response.payload = "unknown verb: " + request.verb;
+        }
+        bool sent = send(response);
+        if (completion_cache.needs_compaction()) {
+            std::thread([]() { completion_cache.compact_now(); }).detach();
+        }
+        if (!sent) break;
+    }
+    close(fd);
+}
+
+#if defined(__linux__)
+// Whether the netlink messages in [buf, buf + len) can break the provider
+// connections: a default route came or went, or the address a connection
+// was made from was removed. Router advertisements renewing temporary
+// IPv6 addresses or a container's veth interface coming up do not.
+static bool breaks_connections(const char* buf, int len) {
+    for (const nlmsghdr* msg = (const nlmsghdr*)buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+        if (msg->nlmsg_type == RTM_NEWROUTE || msg->nlmsg_type == RTM_DELROUTE) {
+            const rtmsg* route = (const rtmsg*)NLMSG_DATA(msg);
+            if (route->rtm_dst_len == 0 && route->rtm_table != RT_TABLE_LOCAL) return true;
+        } else if (msg->nlmsg_type == RTM_DELADDR) {
+            const ifaddrmsg* ifa = (const ifaddrmsg*)NLMSG_DATA(msg);
+            int attr_len = IFA_PAYLOAD(msg);
+            for (const rtattr* attr = IFA_RTA(ifa); RTA_OK(attr, attr_len); attr = RTA_NEXT(attr, attr_len)) {
+                if (attr->rta_type != IFA_ADDRESS && attr->rta_type != IFA_LOCAL) continue;
+                char ip[INET6_ADDRSTRLEN];
+                if (inet_ntop(ifa->ifa_family, RTA_DATA(attr), ip, sizeof(ip)) && connected_from(ip)) return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Reconnect when the default route changes or the connections' local
+// address goes away (a new Wi-Fi network, a VPN coming up, resume from
+// suspend): the cached connections would only fail on the next completion.
+static void watch_network_changes() {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) return;
+    sockaddr_nl addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return;
+    }
+
+    alignas(nlmsghdr) char buf[8192];
+    // Messages were dropped (ENOBUFS): whatever they said counts
+    auto relevant = [&](ssize_t n) { return n < 0 ? errno == ENOBUFS : breaks_connections(buf, (int)n); };
+    for (;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno != EINTR && errno != ENOBUFS) break;
+        bool reset = relevant(n);
+        // Changes come in bursts; act once things have been quiet for a second
+        pollfd pfd = {fd, POLLIN, 0};
+        while (poll(&pfd, 1, 1000) > 0) {
+            n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno != EINTR && errno != ENOBUFS) break;
+            if (relevant(n)) reset = true;
+        }
+        if (!reset) continue;
+        reset_connections();
+        prewarmer.warm(true, false);
+    }
+    close(fd);
+}
+#endif
+
+int run_daemon() {
+    std::string path = daemon_socket_path();
+    sockaddr_un addr;
+    if (!fill_socket_address(path, addr)) {
+        return 1;
+    }
+
+    // A socket that still accepts connections belongs to a live daemon;
+    // anything else is left over from a previous run and can be replaced.
+    int probe = connect_daemon_socket(path);
+    if (probe >= 0) {
+        close(probe);
+        std::cerr << "Daemon already running on " << path << std::endl;
+        return 1;
+    }
+    unlink(path.c_str());
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "socket() failed: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    mode_t old_mask = umask(077);
+    int bound = bind(listen_fd, (sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(listen_fd, 64) < 0) {
+        std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno) << std::endl;
+        close(listen_fd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    transport.start();
+    // Have the local suggestion sources ready before the first keypress
+    std::thread([]() { local_history.refresh(); }).detach();
+#if defined(__linux__)
+    std::thread(watch_network_changes).detach();
+#endif
+    std::cerr << "shell_complete daemon listening on " << path << std::endl;
+
+    for (;;) {
+        int client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "accept() failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        std::thread(serve_client, client_fd).detach();
+    }
+
+    close(listen_fd);
+    transport.stop();
+    cleanup_handles();
+    curl_global_cleanup();
+    return 1;
+}
+
+// Forward the command line to a running daemon. Returns false when no
+// daemon is reachable so the caller can fall back to a direct request.
+// With on_chunk set the request is streamed and PART frames are passed on.
+bool complete_via_daemon(const std::string& command_line, std::string& completion,
+                         const ChunkCallback& on_chunk = ChunkCallback()) {
+    int fd = connect_daemon_socket(daemon_socket_path());
+    if (fd < 0) {
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Frame request;
+    request.verb = on_chunk ? "STREAM" : "COMPLETE";
+    request.payload = command_line;
+    Frame response;
+    FrameReader reader(fd);
+    bool ok = write_frame(fd, request);
+    while (ok && (ok = reader.read_frame(response)) &&
+           (response.verb == "PART" || response.verb == "PROVISIONAL")) {
+        if (on_chunk && response.verb == "PART") on_chunk(response.payload);
+    }
+    close(fd);
+
+    if (!ok) {
+        return false;
+    }
+    if (response.verb != "OK") {
+        std::cerr << "Daemon error: " << response.payload << std::endl;
+        completion.clear();
+        return true;
+    }
+    completion = response.payload;
+    return true;
+}
+
+// --prewarm: have the daemon open its connections, or without a daemon
+// leave fresh DNS answers and TLS sessions for the next one-shot run
+int run_prewarm() {
+    int fd = connect_daemon_socket(daemon_socket_path());
+    if (fd >= 0) {
+        signal(SIGPIPE, SIG_IGN);
+        Frame request;
+        request.verb = "PREWARM";
+        Frame response;
+        FrameReader reader(fd);
+        bool ok = write_frame(fd, request) && reader.read_frame(response) && response.verb == "OK";
+        close(fd);
+        if (ok) return 0;
+    }
+
+    connection_cache.load();
+    // One thread per provider; their transfers run on the transport
+    transport.start();
+    prewarmer.warm(true, true);
+    transport.stop();
+    connection_cache.save();
+    cleanup_handles();
+    return 0;
+}
+
+// History candidates for --local: from the daemon's resident index when
+// one is running, otherwise by indexing the history file here
+std::vector<std::string> local_candidates(const std::string& prefix) {
+    int fd = connect_daemon_socket(daemon_socket_path());
+    if (fd >= 0) {
+        signal(SIGPIPE, SIG_IGN);
+        Frame request;
+        request.verb = "LOCAL";
+        request.payload = prefix;
+        Frame response;
+        FrameReader reader(fd);
+        bool ok = write_frame(fd, request) && reader.read_frame(response) && response.verb == "OK";
+        close(fd);
+        if (ok) {
+            std::vector<std::string> candidates;
+            std::stringstream lines(response.payload);
+            std::string line;
+            while (std::getline(lines, line)) candidates.push_back(line);
+            return candidates;
+        }
+    }
+
+    // Without the daemon the file is read again on every call; keeping
+    // only the commands that match at least spares indexing the rest
+    HistoryIndex index;
+    index.load(history_file_path(), prefix);
+    return index.query(prefix, LOCAL_CANDIDATES);
+}
+
+// --eval: completion quality against latency, over a corpus of commands
+// with known good answers. The corpus has one case per line: the input
+// and then every acceptable completion, separated by tabs; blank lines
+// and lines starting with '#' are skipped. Each --config (comma-separated
+// key=value settings, see eval_config_env()) is one configuration; without
+// any the settings come from the environment. A configuration runs in a
+// child process of its own, because models and request templates are
+// fixed for the life of a process. Cases bypass the completion cache and
+// go --jobs at a time.
+struct EvalCase {
+    std::string input;
+    std::vector<std::string> accepted;
+};
+
+static bool load_eval_corpus(const std::string& path, std::vector<EvalCase>& cases) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Cannot read " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        EvalCase c;
+        std::stringstream fields(line);
+        std::string field;
+        std::getline(fields, c.input, '\t');
+        while (std::getline(fields, field, '\t')) {
+            if (!field.empty()) c.accepted.push_back(field);
+        }
+        if (c.input.empty() || c.accepted.empty()) {
+            std::cerr << path << ":" << number << ": expected input<TAB>completion[<TAB>completion...]" << std::endl;
+            return false;
+        }
+        cases.push_back(c);
+    }
+    return true;
+}
+
+// Environment for one configuration. Keys: provider, model (of that
+// provider), reasoning_effort, max_tokens and hedge_ms.
+static bool eval_config_env(const std::string& spec, std::vector<std::pair<std::string, std::string>>& env) {
+    const char* provider_env = std::getenv("SHELL_COMPLETE_PROVIDER");
+    std::string provider = provider_env ? provider_env : "cerebras";
+    std::stringstream items(spec);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+        if (key == "provider") {
+            provider = value;
+            env.emplace_back("SHELL_COMPLETE_PROVIDER", value);
+        } else if (key == "model") {
+            env.emplace_back(provider == "anthropic" ? "SHELL_COMPLETE_ANTHROPIC_MODEL" : "SHELL_COMPLETE_CEREBRAS_MODEL",
+                             value);
+        } else if (key == "reasoning_effort") {
+            env.emplace_back("SHELL_COMPLETE_REASONING_EFFORT", value);
+        } else if (key == "max_tokens") {
+            env.emplace_back("SHELL_COMPLETE_MAX_TOKENS", value);
+        } else if (key == "hedge_ms") {
+            env.emplace_back("SHELL_COMPLETE_HEDGE_MS", value);
+        } else if (!key.empty()) {
+            std::cerr << "Unknown setting in --config " << spec << ": " << key << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Form compared for the normalized score: whitespace as in
+// normalize_input(), double quotes taken as single quotes and no
+// trailing semicolon
+static std::string normalize_command(const std::string& command) {
+    std::string out = normalize_input(command);
+    std::replace(out.begin(), out.end(), '"', '\'');
+    while (!out.empty() && (out.back() == ';' || out.back() == ' ')) out.pop_back();
+    return out;
+}
+
+// Child side: run every case and write [{"output", "us"}, ...] to fd
+static void run_eval_configuration(const std::vector<EvalCase>& cases, int jobs, int fd) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    // The workers' transfers share connections, so they run on the transport
+    transport.start();
+    json outcomes = json::array();
+    for (size_t i = 0; i < cases.size(); ++i) outcomes.push_back({{"output", ""}, {"us", 0}});
+    std::mutex outcomes_mutex;
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; ++j) {
+        workers.emplace_back([&]() {
+            for (size_t i; (i = next++) < cases.size();) {
+                long long start_ns = steady_ns();
+                std::string output = complete_remote(cases[i].input, ChunkCallback());
+                long long us = (steady_ns() - start_ns) / 1000;
+                std::lock_guard<std::mutex> lock(outcomes_mutex);
+                outcomes[i]["output"] = output;
+                outcomes[i]["us"] = us;
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    transport.stop();
+    std::string text = outcomes.dump();
+    write_all(fd, text.data(), text.size());
+    cleanup_handles();
+}
+
+int run_eval(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " --eval <corpus> [--config key=value,...]... [--jobs N] [--cases FILE]"
+                  << std::endl;
+        return 1;
+    }
+    std::string corpus_path = argv[2];
+    std::vector<std::string> configs;
+    int jobs = 4;
+    std::string cases_path;
+    for (int i = 3; i < argc; ++i) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << std::endl;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--config") {
+            configs.push_back(value);
+        } else if (option == "--jobs") {
+            jobs = std::max(1, std::atoi(value.c_str()));
+        } else if (option == "--cases") {
+            cases_path = value;
+        } else {
+            std::cerr << "Unknown --eval option: " << option << std::endl;
+            return 1;
+        }
+    }
+    if (configs.empty()) configs.push_back("");
+
+    std::vector<EvalCase> cases;
+    if (!load_eval_corpus(corpus_path, cases)) return 1;
+    if (cases.empty()) {
+        std::cerr << "No cases in " << corpus_path << std::endl;
+        return 1;
+    }
+    std::vector<std::vector<std::pair<std::string, std::string>>> envs(configs.size());
+    for (size_t c = 0; c < configs.size(); ++c) {
+        if (!eval_config_env(configs[c], envs[c])) return 1;
+    }
+    std::ofstream cases_out;
+    if (!cases_path.empty()) {
+        cases_out.open(cases_path);
+        cases_out << "config\tinput\toutput\tlatency_ms\tscore\n";
+    }
+
+    char line[512];
+    snprintf(line, sizeof(line), "%-44s %6s %6s %7s %10s %9s %9s\n", "configuration", "cases", "failed", "exact",
+             "normalized", "p50 ms", "p95 ms");
+    std::cout << line << std::flush;
+    int status = 0;
+    for (size_t c = 0; c < configs.size(); ++c) {
+        int fds[2];
+        if (pipe(fds) < 0) {
+            std::cerr << "pipe() failed: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            for (const auto& setting : envs[c]) setenv(setting.first.c_str(), setting.second.c_str(), 1);
+            // Evaluation traffic stays out of the latency statistics
+            setenv("SHELL_COMPLETE_STATS", "0", 1);
+            run_eval_configuration(cases, jobs, fds[1]);
+            _exit(0);
+        }
+        close(fds[1]);
+        std::string text;
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fds[0], buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+            if (n > 0) text.append(buf, (size_t)n);
+        }
+        close(fds[0]);
+        if (pid > 0) waitpid(pid, nullptr, 0);
+
+        std::string label = configs[c].empty() ? "(environment)" : configs[c];
+        json outcomes = json::parse(text, nullptr, false);
+        if (pid < 0 || !outcomes.is_array() || outcomes.size() != cases.size()) {
+            std::cout << label << ": evaluation did not finish" << std::endl;
+            status = 1;
+            continue;
+        }
+
+        size_t failed = 0, exact = 0, normalized = 0;
+        std::vector<long long> latencies;
+        for (size_t i = 0; i < cases.size(); ++i) {
+            std::string output = outcomes[i]["output"].get<std::string>();
+            long long us = outcomes[i]["us"].get<long long>();
+            const char* score = "miss";
+            if (output.empty()) {
+                score = "failed";
+                ++failed;
+            } else {
+                latencies.push_back(us);
+                for (const std::string& accepted : cases[i].accepted) {
+                    if (output == accepted) {
+                        score = "exact";
+                        break;
+                    }
+                    if (normalize_command(output) == normalize_command(accepted)) score = "normalized";
+                }
+                if (std::strcmp(score, "exact") == 0) ++exact;
+                if (std::strcmp(score, "miss") != 0) ++normalized;
+            }
+            if (cases_out.is_open()) {
+                std::string flat = output;
+                std::replace(flat.begin(), flat.end(), '\t', ' ');
+                std::replace(flat.begin(), flat.end(), '\n', ' ');
+                snprintf(line, sizeof(line), "%.3f", us / 1000.0);
+                cases_out << label << '\t' << cases[i].input << '\t' << flat << '\t' << line << '\t' << score << '\n';
+            }
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile_ms = [&](double q) {
+            if (latencies.empty()) return 0.0;
+            size_t i = (size_t)(q * latencies.size() + 0.999999);
+            return latencies[std::max<size_t>(i, 1) - 1] / 1000.0;
+        };
+        snprintf(line, sizeof(line), "%-44.44s %6zu %6zu %6.1f%% %9.1f%% %9.1f %9.1f\n", label.c_str(), cases.size(),
+                 failed, 100.0 * exact / cases.size(), 100.0 * normalized / cases.size(), percentile_ms(0.50),
+                 percentile_ms(0.95));
+        std::cout << line << std::flush;
+    }
+    return status;
+}
+
+// test_llm.cpp includes this file to test the real request code
+#ifndef SHELL_COMPLETE_NO_MAIN
 int main(int argc, char* argv[]) {
+    // Options that apply to every mode come first; each is dropped from
+    // the arguments once handled. argv itself stays intact for a re-exec.
+    std::vector<char*> args(argv, argv + argc + 1);
+    while (args.size() > 2) {
+        std::string option = args[1];
+        if (option == "--startup-profile") {
+            startup_profile = start_startup_profile(argv);
+            args.erase(args.begin() + 1);
+        } else if (option == "--timing" && args.size() > 3) {
+            if (std::string(args[2]) != "json") {
+                std::cerr << "Unknown timing format: " << args[2] << " (expected json)" << std::endl;
+                return 1;
+            }
+            timing_json = true;
+            args.erase(args.begin() + 1, args.begin() + 3);
+        } else {
+            break;
+        }
+    }
+    argc = (int)args.size() - 1;
+    argv = args.data();
+
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <partial_command>" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " [--stream] <partial_command>" << std::endl;
+        std::cerr << "       " << argv[0] << " --local <partial_command>" << std::endl;
+        std::cerr << "       " << argv[0] << " --daemon" << std::endl;
+        std::cerr << "       " << argv[0] << " --prewarm" << std::endl;
+        std::cerr << "       " << argv[0] << " --stats [reset]" << std::endl;
+        std::cerr << "       " << argv[0] << " --eval <corpus> [--config key=value,...]... [--jobs N] [--cases FILE]"
+                  << std::endl;
+        std::cerr << "       " << argv[0] << " --startup-profile [--stream|--local] <partial_command>" << std::endl;
+        std::cerr << "       " << argv[0] << " --timing json [--daemon | [--stream] <partial_command>]" << std::endl;
         return 1;
     }
 
+    if (std::string(argv[1]) == "--daemon") {
+        return run_daemon();
+    }
+    if (std::string(argv[1]) == "--prewarm") {
+        return run_prewarm();
+    }
+    if (std::string(argv[1]) == "--eval") {
+        return run_eval(argc, argv);
+    }
+    if (std::string(argv[1]) == "--stats") {
+        if (argc > 2 && std::string(argv[2]) == "reset") {
+            if (!latency_stats.reset()) {
+                std::cerr << "Could not reset statistics" << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+        latency_stats.print(std::cout);
+        return 0;
+    }
+
+    // --stream prints the completion piece by piece as it is generated;
+    // --local prints matching commands from history and never goes remote
+    int first_arg = 1;
+    bool stream = false;
+    bool local = false;
+    if (std::string(argv[1]) == "--stream") {
+        stream = true;
+        first_arg = 2;
+    } else if (std::string(argv[1]) == "--local") {
+        local = true;
+        first_arg = 2;
+    }
+
     std::string command_line;
-    for (int i = 1; i < argc; ++i) {
-        if (i > 1) command_line += " ";
+    for (int i = first_arg; i < argc; ++i) {
+        if (i > first_arg) command_line += " ";
         command_line += argv[i];
     }
 
-    std::string completion = call_llm_cerebras(command_line);
-    if (!completion.empty()) {
+    if (local) {
+        long long local_ns = steady_ns();
+        std::vector<std::string> candidates = local_candidates(command_line);
+        latency_stats.record("local", "", "", (steady_ns() - local_ns) / 1000, !candidates.empty());
+        for (const std::string& candidate : candidates) {
+            std::cout << candidate << "\n";
+        }
+        if (startup_profile) {
+            std::cout.flush();
+            startup_profile->mark("local candidates");
+            startup_profile->report();
+        }
+        return 0;
+    }
+
+    ChunkCallback on_chunk;
+    bool printed = false;
+    if (stream) {
+        on_chunk = [&](const std::string& piece) {
+            std::cout << piece << std::flush;
+            printed = true;
+        };
+    }
+
+    // Cache hits are answered right here, before libcurl or the daemon
+    // socket are touched
+    std::string completion;
+    long long lookup_ns = steady_ns();
+    if (completion_cache.lookup(completion_cache_key(command_line), completion)) {
+        latency_stats.cache_lookup(true);
+        latency_stats.record("cache", "", "", (steady_ns() - lookup_ns) / 1000, true);
+        std::cout << completion << std::endl;
+        if (startup_profile) {
+            startup_profile->mark("completion cache hit");
+            startup_profile->report();
+        }
+        return 0;
+    }
+    if (startup_profile) startup_profile->mark("completion cache miss");
+
+    bool direct = false;
+    if (!complete_via_daemon(command_line, completion, on_chunk) && !printed) {
+        if (startup_profile) startup_profile->mark("daemon unavailable");
+        // Without a daemon, start from the addresses and TLS sessions the
+        // previous run left behind. libcurl and TLS are only initialized
+        // here, on the one path that needs them.
+        direct = true;
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        if (startup_profile) startup_profile->mark("libcurl and TLS init");
+        connection_cache.load();
+        if (startup_profile) startup_profile->mark("connection cache load");
+        completion = complete_command(command_line, on_chunk);
+        if (startup_profile) startup_profile->mark("request");
+    } else if (startup_profile) {
+        startup_profile->mark("daemon");
+    }
+    if (stream) {
+        if (printed) std::cout << std::endl;
+    } else if (!completion.empty()) {
         std::cout << completion << std::endl;
     }
+    if (direct) {
+        std::cout.flush();
+        connection_cache.save();
+        cleanup_handles();
+    }
+    if (startup_profile) {
+        std::cout.flush();
+        startup_profile->mark("output and cleanup");
+        startup_profile->report();
+    }
+
+    // Compact a full cache in a detached child so the shell, which waits
+    // for our stdout to close, is not held up
+    if (completion_cache.needs_compaction()) {
+        std::cout.flush();
+        if (fork() == 0) {
+            int devnull = open("/dev/null", O_RDWR);
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            completion_cache.compact_now();
+            _exit(0);
+        }
+    }
 
     return 0;
 }
+#endif  // SHELL_COMPLETE_NO_MAIN
@@ -1,239 +1,218 @@
-#include <iostream>
-#include <string>
-#include <cstdlib>
-#include <curl/curl.h>
-#include "json.hpp"
-
-using json = nlohmann::json;
-
-// Callback for libcurl to write response data
-size_t write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t total_size = size * nmemb;
-    ((std::string*)userp)->append((char*)contents, total_size);
-    return total_size;
-}
-
-std::string call_llm_cerebras(const std::string& command_line) {
-    const char* api_key = std::getenv("CEREBRAS_API_KEY");
-    if (!api_key) {
-        std::cerr << "Error: CEREBRAS_API_KEY not set" << std::endl;
-        return "";
-    }
-
-    // Build JSON payload using nlohmann::json
-    json request;
-    request["model"] = "gpt-oss-120b";
-    request["stream"] = false;
-    request["max_tokens"] = 150;
-    request["temperature"] = 1;
-    request["top_p"] = 1;
-    request["reasoning_effort"] = "medium";
-    request["messages"] = json::array({
-        {{"role", "system"}, {"content", "You complete shell commands. Return ONLY the complete command, no explanations.\n\n"
-                                         "Examples:\n"
-                                         "Input: list all files\n"
-                                         "Output: ls -la\n\n"
-                                         "Input: find pdf files\n"
-                                         "Output: find . -name \"*.pdf\"\n\n"
-                                         "Input: compress logs\n"
-                                         "Output: tar -czf logs.tar.gz *.log"}},
-        {{"role", "user"}, {"content", "Input: " + command_line + "\nOutput:"}}
-    });
-
-    std::string json_payload = request.dump();
-    std::string response;
-
-    // Initialize curl
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        std::cerr << "Failed to initialize curl" << std::endl;
-        return "";
-    }
-
-    // Set curl options
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, ("Authorization: Bearer " + std::string(api_key)).c_str());
-
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.cerebras.ai/v1/chat/completions");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_payload.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-    // Perform request
-    CURLcode res = curl_easy_perform(curl);
-
-    // Cleanup
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-
-    if (res != CURLE_OK) {
-        std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-        return "";
-    }
-
-    // Parse JSON response using nlohmann::json (OpenAI-compatible format)
-    try {
-        auto j = json::parse(response);
-        if (j.contains("choices") && j["choices"].is_array() && !j["choices"].empty()) {
-            if (j["choices"][0].contains("message") && j["choices"][0]["message"].contains("content")) {
-                return j["choices"][0]["message"]["content"].get<std::string>();
-            }
+// Checks both providers with a few completions through the same request
+// code shell_complete uses. Runs against the live APIs by default, or
+// offline from recorded fixtures (see HttpFixtures in shell_complete.cpp):
+//   SHELL_COMPLETE_FIXTURES=fixtures/test_llm.fixtures SHELL_COMPLETE_FIXTURE_MODE=strict ./test_llm
+//
+// The cases run on one curl multi handle (a TransferGroup), -j at a time
+// (default 4), so the suite takes about as long as its slowest case.
+// Replayed cases overlap the same way, each on a thread of its own.
+// A live case passes when its provider returns a non-empty completion; a
+// replayed one must decode to exactly the completion that was recorded
+// (the checked-in fixtures come from mock_llm_server, which echoes the
+// input; update `recorded` after "make record-fixtures"). Before the
+// cases, response decoding is checked offline on a few escaped strings.
+#define SHELL_COMPLETE_NO_MAIN
+#include "shell_complete.cpp"
+
+struct TestCase {
+    Provider provider;
+    const char* name;
+    const char* input;
+    // Completion in fixtures/test_llm.fixtures
+    const char* recorded;
+};
+
+static const TestCase test_cases[] = {
+    {PROVIDER_ANTHROPIC, "Simple completion", "find all pdf files", "find all pdf files --mock"},
+    {PROVIDER_ANTHROPIC, "Command correction", "list files in current dir", "list files in current dir --mock"},
+    {PROVIDER_ANTHROPIC, "Complex command", "compress all log files", "compress all log files --mock"},
+    {PROVIDER_CEREBRAS, "Simple completion", "find all pdf files", "find all pdf files --mock"},
+    {PROVIDER_CEREBRAS, "Command correction", "list files in current dir", "list files in current dir --mock"},
+    {PROVIDER_CEREBRAS, "Complex command", "compress all log files", "compress all log files --mock"},
+};
+
+static const size_t TEST_COUNT = sizeof(test_cases) / sizeof(test_cases[0]);
+
+// A JSON string as a provider may send it and the text it decodes to
+struct DecodeCase {
+    const char* json;
+    const char* text;
+};
+
+static const DecodeCase decode_cases[] = {
+    {"\"ls -la\"", "ls -la"},
+    {"\"echo \\\"a\\tb\\\"\\n\"", "echo \"a\tb\"\n"},
+    {"\"caf\\u00e9 \\u20ac\"", "caf\xc3\xa9 \xe2\x82\xac"},
+    {"\"\\ud83d\\ude00\"", "\xf0\x9f\x98\x80"},
+    // Unpaired surrogates
+    {"\"a\\ud800b\"", "a\xef\xbf\xbd" "b"},
+    {"\"\\udc00\"", "\xef\xbf\xbd"},
+    {"\"\\ud800\\u0041\"", "\xef\xbf\xbd" "A"},
+};
+
+// Number of decode_cases that do not decode as expected
+static int check_decoding() {
+    int failed = 0;
+    for (const DecodeCase& test : decode_cases) {
+        JsonSpan span;
+        span.begin = test.json;
+        span.end = test.json + std::strlen(test.json);
+        std::string text;
+        if (!span.unescape_into(text) || text != test.text) {
+            std::cout << "FAIL  decoding " << test.json << std::endl;
+            ++failed;
         }
-    } catch (const json::exception& e) {
-        std::cerr << "JSON parse error: " << e.what() << std::endl;
     }
-
-    return "";
+    return failed;
 }
 
-std::string call_llm(const std::string& command_line) {
-    const char* api_key = std::getenv("ANTHROPIC_API_KEY");
-    if (!api_key) {
-        std::cerr << "Error: ANTHROPIC_API_KEY not set" << std::endl;
-        return "";
-    }
-
-    // Build JSON payload using nlohmann::json
-    json request;
-    request["model"] = "claude-haiku-4-5-20251001";
-    request["max_tokens"] = 150;
-    request["system"] = "You complete shell commands. Return ONLY the complete command, no explanations.\n\n"
-                        "Examples:\n"
-                        "Input: list all files\n"
-                        "Output: ls -la\n\n"
-                        "Input: find pdf files\n"
-                        "Output: find . -name \"*.pdf\"\n\n"
-                        "Input: compress logs\n"
-                        "Output: tar -czf logs.tar.gz *.log";
-    request["messages"] = json::array({
-        {{"role", "user"}, {"content", "Input: " + command_line + "\nOutput:"}}
-    });
-
-    std::string json_payload = request.dump();
-    std::string response;
-
-    // Initialize curl
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        std::cerr << "Failed to initialize curl" << std::endl;
-        return "";
-    }
-
-    // Set curl options
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, ("x-api-key: " + std::string(api_key)).c_str());
-    headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
-
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.anthropic.com/v1/messages");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_payload.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-
-    // Perform request
-    CURLcode res = curl_easy_perform(curl);
-
-    // Cleanup
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-
-    if (res != CURLE_OK) {
-        std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-        return "";
-    }
-
-    // Parse JSON response using nlohmann::json
-    try {
-        auto j = json::parse(response);
-        if (j.contains("content") && j["content"].is_array() && !j["content"].empty()) {
-            if (j["content"][0].contains("text")) {
-                return j["content"][0]["text"].get<std::string>();
-            }
+struct TestResult {
+    enum { SKIPPED, PASSED, FAILED } status = SKIPPED;
+    std::string completion;
+    long long us = 0;
+};
+
+int main(int argc, char* argv[]) {
+    int jobs = 4;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc) {
+            jobs = std::max(1, std::atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [-j parallel_cases]" << std::endl;
+            return 1;
         }
-    } catch (const json::exception& e) {
-        std::cerr << "JSON parse error: " << e.what() << std::endl;
     }
 
-    return "";
-}
+    int decode_failed = check_decoding();
 
-int main() {
-    bool has_anthropic = std::getenv("ANTHROPIC_API_KEY") != nullptr;
-    bool has_cerebras = std::getenv("CEREBRAS_API_KEY") != nullptr;
+    // Replayed requests need no credentials
+    if (http_fixtures.replaying()) {
+        setenv("ANTHROPIC_API_KEY", "fixture", 0);
+        setenv("CEREBRAS_API_KEY", "fixture", 0);
+    }
 
-    if (!has_anthropic && !has_cerebras) {
+    bool has_key[PROVIDER_COUNT];
+    for (int p = 0; p < PROVIDER_COUNT; ++p) has_key[p] = has_api_key((Provider)p);
+    if (!has_key[PROVIDER_ANTHROPIC] && !has_key[PROVIDER_CEREBRAS]) {
         std::cerr << "Error: Neither ANTHROPIC_API_KEY nor CEREBRAS_API_KEY is set" << std::endl;
         return 1;
     }
 
-    bool all_passed = true;
-
-    // Test Anthropic Claude
-    if (has_anthropic) {
-        std::cout << "=== Testing Anthropic Claude Haiku 4.5 ===\n" << std::endl;
-
-        std::cout << "Test 1: Simple completion" << std::endl;
-        std::cout << "Input: 'find all pdf files'" << std::endl;
-        std::string result1 = call_llm("find all pdf files");
-        std::cout << "Result: " << result1 << std::endl;
-        std::cout << std::endl;
-
-        std::cout << "Test 2: Command correction" << std::endl;
-        std::cout << "Input: 'list files in current dir'" << std::endl;
-        std::string result2 = call_llm("list files in current dir");
-        std::cout << "Result: " << result2 << std::endl;
-        std::cout << std::endl;
-
-        std::cout << "Test 3: Complex command" << std::endl;
-        std::cout << "Input: 'compress all log files'" << std::endl;
-        std::string result3 = call_llm("compress all log files");
-        std::cout << "Result: " << result3 << std::endl;
-        std::cout << std::endl;
-
-        if (result1.empty() || result2.empty() || result3.empty()) {
-            std::cout << "Anthropic tests failed!" << std::endl;
-            all_passed = false;
-        } else {
-            std::cout << "Anthropic tests passed!" << std::endl;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    std::vector<TestResult> results(TEST_COUNT);
+    long long suite_start_ns = steady_ns();
+    {
+        std::vector<std::unique_ptr<ProviderRequest>> requests(TEST_COUNT);
+        std::vector<long long> started_ns(TEST_COUNT);
+        // Recorded exchanges play back at their recorded pace (scaled by
+        // SHELL_COMPLETE_FIXTURE_SPEED), one thread each so they overlap
+        // like live transfers; finished ones are picked up by the loop
+        std::vector<std::thread> replays;
+        std::mutex replay_mutex;
+        std::vector<std::pair<size_t, CURLcode>> replayed;
+        std::vector<size_t> not_recorded;
+        // Declared after the requests it drives, so it lets go of them first
+        TransferGroup group;
+
+        auto finish = [&](size_t i, CURLcode res) {
+            results[i].completion = finish_request(*requests[i], res);
+            results[i].us = (steady_ns() - started_ns[i]) / 1000;
+            bool ok = !results[i].completion.empty();
+            if (requests[i]->replayed_us >= 0) ok = results[i].completion == test_cases[i].recorded;
+            results[i].status = ok ? TestResult::PASSED : TestResult::FAILED;
+            requests[i].reset();
+        };
+
+        size_t next = 0;
+        int in_flight = 0, replaying = 0;
+        while (next < TEST_COUNT || in_flight > 0) {
+            while (next < TEST_COUNT && in_flight < jobs) {
+                size_t i = next++;
+                if (!has_key[test_cases[i].provider]) continue;
+                started_ns[i] = steady_ns();
+                requests[i] = prepare_request(test_cases[i].provider, test_cases[i].input, ChunkCallback());
+                if (!requests[i]) {
+                    results[i].status = TestResult::FAILED;
+                    continue;
+                }
+                ++in_flight;
+                if (http_fixtures.replaying()) {
+                    ++replaying;
+                    ProviderRequest* req = requests[i].get();
+                    replays.emplace_back([&, i, req]() {
+                        CURLcode res;
+                        bool found = http_fixtures.replay(*req, res);
+                        std::lock_guard<std::mutex> lock(replay_mutex);
+                        if (found) {
+                            replayed.emplace_back(i, res);
+                        } else {
+                            not_recorded.push_back(i);
+                        }
+                    });
+                } else {
+                    group.add(*requests[i]);
+                }
+            }
+            if (in_flight == 0) continue;
+
+            // Poll briefly while replays run, since they cannot wake the
+            // multi handle
+            for (ProviderRequest* req : group.wait(replaying > 0 ? 2 : 100)) {
+                for (size_t i = 0; i < TEST_COUNT; ++i) {
+                    if (requests[i].get() != req) continue;
+                    finish(i, req->result);
+                    --in_flight;
+                    break;
+                }
+            }
+            std::vector<std::pair<size_t, CURLcode>> done;
+            std::vector<size_t> live;
+            {
+                std::lock_guard<std::mutex> lock(replay_mutex);
+                done.swap(replayed);
+                live.swap(not_recorded);
+            }
+            for (const auto& replay : done) {
+                finish(replay.first, replay.second);
+                --in_flight;
+                --replaying;
+            }
+            // Not in the fixtures (and not strict): a live transfer after all
+            for (size_t i : live) {
+                --replaying;
+                group.add(*requests[i]);
+            }
         }
-        std::cout << std::endl;
+        for (auto& replay : replays) replay.join();
     }
-
-    // Test Cerebras
-    if (has_cerebras) {
-        std::cout << "=== Testing Cerebras gpt-oss-120b ===\n" << std::endl;
-
-        std::cout << "Test 1: Simple completion" << std::endl;
-        std::cout << "Input: 'find all pdf files'" << std::endl;
-        std::string result1 = call_llm_cerebras("find all pdf files");
-        std::cout << "Result: " << result1 << std::endl;
-        std::cout << std::endl;
-
-        std::cout << "Test 2: Command correction" << std::endl;
-        std::cout << "Input: 'list files in current dir'" << std::endl;
-        std::string result2 = call_llm_cerebras("list files in current dir");
-        std::cout << "Result: " << result2 << std::endl;
-        std::cout << std::endl;
-
-        std::cout << "Test 3: Complex command" << std::endl;
-        std::cout << "Input: 'compress all log files'" << std::endl;
-        std::string result3 = call_llm_cerebras("compress all log files");
-        std::cout << "Result: " << result3 << std::endl;
-        std::cout << std::endl;
-
-        if (result1.empty() || result2.empty() || result3.empty()) {
-            std::cout << "Cerebras tests failed!" << std::endl;
-            all_passed = false;
-        } else {
-            std::cout << "Cerebras tests passed!" << std::endl;
-        }
-        std::cout << std::endl;
+    long long suite_us = (steady_ns() - suite_start_ns) / 1000;
+
+    int passed = 0, failed = 0;
+    long long total_us = 0;
+    char line[256];
+    for (size_t i = 0; i < TEST_COUNT; ++i) {
+        const TestCase& test = test_cases[i];
+        const TestResult& result = results[i];
+        const char* status = result.status == TestResult::PASSED ? "PASS"
+                             : result.status == TestResult::FAILED ? "FAIL"
+                                                                   : "SKIP";
+        snprintf(line, sizeof(line), "%s  %-10s %-20s %-28s %8.1f ms  ", status, provider_name(test.provider),
+                 test.name, ("'" + std::string(test.input) + "'").c_str(), result.us / 1000.0);
+        std::cout << line << (result.status == TestResult::SKIPPED ? "(no API key)" : result.completion)
+                  << std::endl;
+        passed += result.status == TestResult::PASSED;
+        failed += result.status == TestResult::FAILED;
+        total_us += result.us;
     }
 
-    if (all_passed) {
+    snprintf(line, sizeof(line), "\n%d passed, %d failed, %d skipped in %.2f s (%.2f s if run one by one, -j %d)",
+             passed, failed, (int)TEST_COUNT - passed - failed, suite_us / 1e6, total_us / 1e6, jobs);
+    std::cout << line << std::endl;
+    cleanup_handles();
+    curl_global_cleanup();
+
+    if (failed == 0 && decode_failed == 0) {
         std::cout << "All tests passed!" << std::endl;
         return 0;
     } else {